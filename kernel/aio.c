@@ -0,0 +1,290 @@
+//
+// Asynchronous file I/O, so that a process can go on computing
+// while the disk works. aioread() and aiowrite() queue a request
+// and return an id at once; NAIOTHREAD kernel threads (kproc())
+// take requests from the queue in order and carry them out
+// through the buffer cache, sleeping for the disk in the
+// process's place. aiowait() collects the result of a finished
+// request, waiting for it or not, as the caller asks.
+//
+// Each request has a bounce buffer of its own, so the threads
+// never touch the process's memory: aiowrite() copies the data
+// in when it queues the request, and aiowait() copies what was
+// read out. The process may reuse its buffer meanwhile, and it
+// can't be written to until the process asks for the result.
+// The bounce buffer is a list of pages from kalloc(), and the
+// threads move a request's data a page at a time, so a request
+// may be up to AIOMAX bytes.
+// Requests name their file offset, as pread() and pwrite() do,
+// and hold a reference to the file, so closing the descriptor
+// doesn't disturb them. exit() and exec() wait for a process's
+// requests to finish and discard them.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "defs.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define AIOPAGES (PGSIZE / sizeof(char*))  // bounce pages per request
+#define AIOMAX (AIOPAGES * PGSIZE)
+
+struct aioreq {
+  struct aioreq *next;   // in the queue
+  struct aioreq *pnext;  // in the process's list
+  struct proc *p;
+  int id;
+  int write;
+  struct file *f;
+  uint off;
+  int n;
+  uint64 addr;           // process's buffer
+  char **pg;             // bounce buffer, one page per entry
+  int res;               // bytes moved, or -1
+  int done;
+};
+
+struct {
+  struct spinlock lock;
+  struct aioreq *head;   // queue of requests to carry out
+  struct aioreq *tail;
+} aio;
+
+static void aiothread(void);
+
+void
+aioinit(void)
+{
+  int i;
+
+  initlock(&aio.lock, "aio");
+  for(i = 0; i < NAIOTHREAD; i++)
+    kproc("aio", aiothread);
+}
+
+// Free r's bounce buffer.
+static void
+aiopgfree(struct aioreq *r)
+{
+  int i;
+
+  for(i = 0; i * PGSIZE < r->n; i++)
+    kfree(r->pg[i]);
+  kmfree(r->pg);
+}
+
+// Give r a bounce buffer of r->n bytes. Returns 0, or -1.
+static int
+aiopgalloc(struct aioreq *r)
+{
+  int i, npg = (r->n + PGSIZE - 1) / PGSIZE;
+
+  // kmalloc(0) fails, so ask for at least one entry.
+  if((r->pg = kmalloc((npg > 0 ? npg : 1) * sizeof(char*))) == 0)
+    return -1;
+  for(i = 0; i < npg; i++){
+    if((r->pg[i] = kalloc()) == 0){
+      while(--i >= 0)
+        kfree(r->pg[i]);
+      kmfree(r->pg);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Copy n bytes between p's buffer for r and r's bounce buffer:
+// out to the process if out, else in from it. Returns 0, or -1.
+static int
+aiocopy(struct proc *p, struct aioreq *r, int n, int out)
+{
+  int i, m, tot;
+
+  for(i = 0, tot = 0; tot < n; i++, tot += m){
+    m = min(PGSIZE, n - tot);
+    if(out ? copyout(p->pagetable, r->addr + tot, r->pg[i], m) < 0
+           : copyin(p->pagetable, r->pg[i], r->addr + tot, m) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void
+aiofree(struct aioreq *r)
+{
+  fileclose(r->f);
+  aiopgfree(r);
+  kmfree(r);
+}
+
+// Queue a read (or write, if write is set) of n bytes at offset
+// off of file f, to or from p's buffer at addr.
+// Returns the request's id, or -1.
+int
+aiosubmit(struct proc *p, int write, struct file *f, uint64 addr, int n, int off)
+{
+  struct aioreq *r;
+
+  if(f->type != FD_INODE || n < 0 || n > AIOMAX || off < 0)
+    return -1;
+  if(write ? f->writable == 0 : f->readable == 0)
+    return -1;
+  if((r = kmalloc(sizeof(*r))) == 0)
+    return -1;
+  r->n = n;
+  r->addr = addr;
+  if(aiopgalloc(r) < 0){
+    kmfree(r);
+    return -1;
+  }
+  if(write && aiocopy(p, r, n, 0) < 0){
+    aiopgfree(r);
+    kmfree(r);
+    return -1;
+  }
+  r->p = p;
+  r->write = write;
+  r->f = filedup(f);
+  r->off = off;
+  r->res = 0;
+  r->done = 0;
+  r->next = 0;
+
+  acquire(&aio.lock);
+  if(p->naio >= NAIO){
+    release(&aio.lock);
+    aiofree(r);
+    return -1;
+  }
+  r->id = p->aionext;
+  p->aionext = (p->aionext + 1) & 0x7fffffff;
+  r->pnext = p->aio;
+  p->aio = r;
+  p->naio++;
+  if(aio.tail)
+    aio.tail->next = r;
+  else
+    aio.head = r;
+  aio.tail = r;
+  wakeup(&aio.head);
+  release(&aio.lock);
+  return r->id;
+}
+
+// Carry out request r, a page at a time.
+// Returns the number of bytes moved, or -1.
+static int
+aiodo(struct aioreq *r)
+{
+  int i, m, res, tot;
+
+  for(i = 0, tot = 0; tot < r->n; i++, tot += res){
+    m = min(PGSIZE, r->n - tot);
+    if((res = fileio(r->f, r->write, r->pg[i], m, r->off + tot)) < 0)
+      return tot > 0 ? tot : -1;
+    if(res < m)
+      return tot + res;
+  }
+  return tot;
+}
+
+static void
+aiothread(void)
+{
+  struct aioreq *r;
+  int res;
+
+  acquire(&aio.lock);
+  for(;;){
+    while((r = aio.head) == 0)
+      sleep(&aio.head, &aio.lock);
+    if((aio.head = r->next) == 0)
+      aio.tail = 0;
+    release(&aio.lock);
+
+    res = aiodo(r);
+
+    acquire(&aio.lock);
+    r->res = res;
+    r->done = 1;
+    // r belongs to the process again once done is set.
+    wakeup(&r->p->aio);
+  }
+}
+
+// Collect the result of p's request id, or of any request if id
+// is -1, copying read data out to the process's buffer and the
+// result to user address ures, if not 0. If block is 0, don't
+// wait for the request to finish.
+// Returns the id of the request collected, or -1.
+int
+aiowait(struct proc *p, int id, int block, uint64 ures)
+{
+  struct aioreq *r, **rp;
+  int any;
+
+  acquire(&aio.lock);
+  for(;;){
+    any = 0;
+    for(rp = &p->aio; (r = *rp) != 0; rp = &r->pnext){
+      if(id != -1 && r->id != id)
+        continue;
+      any = 1;
+      if(r->done)
+        break;
+    }
+    if(r || !any || !block || killed(p))
+      break;
+    sleep(&p->aio, &aio.lock);
+  }
+  if(r == 0){
+    release(&aio.lock);
+    return -1;
+  }
+  *rp = r->pnext;
+  p->naio--;
+  release(&aio.lock);
+
+  if(!r->write && r->res > 0 && aiocopy(p, r, r->res, 1) < 0)
+    r->res = -1;
+  id = r->id;
+  if(ures != 0 && copyout(p->pagetable, ures, (char*)&r->res, sizeof(r->res)) < 0)
+    id = -1;
+  aiofree(r);
+  return id;
+}
+
+// Wait for all of p's requests to finish, and discard them.
+void
+aiodrain(struct proc *p)
+{
+  struct aioreq *r;
+
+  acquire(&aio.lock);
+  for(;;){
+    for(r = p->aio; r != 0; r = r->pnext)
+      if(!r->done)
+        break;
+    if(r == 0)
+      break;
+    sleep(&p->aio, &aio.lock);
+  }
+  r = p->aio;
+  p->aio = 0;
+  p->naio = 0;
+  release(&aio.lock);
+
+  while(r){
+    struct aioreq *next = r->pnext;
+    aiofree(r);
+    r = next;
+  }
+}
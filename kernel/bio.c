@@ -7,6 +7,8 @@
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To get a buffer for a block whose old contents will be
+//     entirely overwritten, call bcreate, which skips the read.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
@@ -102,6 +104,19 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it from disk. The contents are undefined; the caller must
+// overwrite all of b->data before releasing it.
+struct buf*
+bcreate(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -2,16 +2,26 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
+struct diriter;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
+
+// aio.c
+void            aioinit(void);
+int             aiosubmit(struct proc*, int, struct file*, uint64, int, int);
+int             aiowait(struct proc*, int, int, uint64);
+void            aiodrain(struct proc*);
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bcreate(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
@@ -31,12 +41,26 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
+int             filereadv(struct file*, struct iovec*, int, int, uint);
+int             filesplice(struct file*, struct file*, int);
+void            filereclaim(void);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewritev(struct file*, struct iovec*, int, int, uint);
+int             fileio(struct file*, int, char*, int, uint);
+
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64, int);
 
 // fs.c
 void            fsinit(int);
+void            dcacheput(struct inode*, char*, uint, uint);
 int             dirlink(struct inode*, char*, uint);
+void            diropen(struct diriter*, struct inode*, uint);
+struct dirent*  dirnext(struct diriter*);
+void            dirclose(struct diriter*);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -57,20 +81,50 @@ void            ireclaim(int);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kallocnoreclaim(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefs(void *);
+void*           kallocmega(void);
 void            kinit(void);
 
+// slab.c
+void            kminit(void);
+void*           kmalloc(uint);
+void            kmfree(void *);
+int             kmreclaim(void);
+
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+struct vma*     vmalookup(struct proc*, uint64);
+uint64          mmapbase(struct proc*);
+uint64          mmap(uint64, int, int, struct file*, int);
+uint64          mmapfault(struct proc*, struct vma*, uint64, int);
+void            mmapprefault(struct proc*, uint64, uint64, int);
+int             munmap(struct proc*, uint64, uint64);
+void            munmapall(struct proc*);
+void            mmapshrink(struct proc*, uint64);
+int             mmapcopy(struct proc*, struct proc*);
+
+// pcache.c
+void            pcacheinit(void);
+uint64          pcacheget(struct inode*, uint, uint, int);
+uint64          pcacheshared(struct inode*, uint);
+void            pcachewrite(struct inode*, uint, char*, uint);
+void            pcacheinval(struct inode*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipesplicein(struct pipe*, struct file*, int);
+int             pipespliceout(struct pipe*, struct file*, int);
 
 // printf.c
 int             printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
@@ -81,7 +135,11 @@ void            printfinit(void);
 int             cpuid(void);
 void            kexit(int);
 int             kfork(void);
-int             growproc(int);
+uint64          growproc(int, int);
+int             kclone(uint64, uint64, uint64);
+int             kjoin(int, uint64);
+void            threadkill(struct proc*);
+int             threaded(struct proc*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -91,10 +149,13 @@ void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+void            procscan(void);
+void            procscandone(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kproc(char*, void (*)(void));
 int             kwait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -123,6 +184,11 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// ring.c
+uint64          ringsetup(struct proc*);
+int             ringcopy(struct proc*, struct proc*);
+int             ringenter(struct proc*, int);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -146,6 +212,11 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// sysfile.c
+struct file*    fdget(struct proc*, int);
+struct file*    fdtake(struct proc*, int);
+int             kopen(char*, int);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -165,8 +236,14 @@ void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             mappagesmega(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
+uint64          uvmallocmega(pagetable_t, uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmdiscard(pagetable_t, uint64, uint64);
+uint64          uvmsatp(struct proc*);
+int             uvmspurious(struct proc*, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
@@ -178,7 +255,9 @@ int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             ismapped(pagetable_t, uint64);
+void            utlbinval(void);
 uint64          vmfault(pagetable_t, uint64, int);
+uint64          uvmfaultmap(struct proc*, uint64, uint64, int);
 
 // plic.c
 void            plicinit(void);
@@ -4,11 +4,19 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
+// Program segments that are paged in on demand; any more are
+// read in by exec() itself.
+#define MAXSEG 4
+
 // map ELF permissions to PTE permission bits.
 int flags2perm(int flags)
 {
@@ -20,6 +28,18 @@ int flags2perm(int flags)
     return perm;
 }
 
+// map ELF permissions to mmap() protection, for a segment vma.
+static int
+flags2prot(int flags)
+{
+  int prot = PROT_READ;
+  if(flags & ELF_PROG_FLAG_EXEC)
+    prot |= PROT_EXEC;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    prot |= PROT_WRITE;
+  return prot;
+}
+
 //
 // the implementation of the exec() system call
 //
@@ -27,14 +47,19 @@ int
 kexec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  struct vma seg[MAXSEG];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // only the leader can replace the process's image.
+  if(p->leader != p)
+    return -1;
+
   begin_op();
 
   // Open the executable file.
@@ -67,6 +92,23 @@ kexec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > MMAPTOP)
+      goto bad;
+    if(nseg < MAXSEG){
+      // leave the segment on disk; vmfault() reads in each
+      // page the first time the program touches it.
+      struct vma *v = &seg[nseg++];
+      v->addr = ph.vaddr;
+      v->len = PGROUNDUP(ph.memsz);
+      v->prot = flags2prot(ph.flags);
+      v->flags = MAP_PRIVATE | VMA_SEGMENT;
+      v->ip = 0;
+      v->off = ph.off;
+      v->filesz = ph.filesz;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -74,6 +116,10 @@ kexec(char *path, char **argv)
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
+  for(i = 0; i < nseg; i++){
+    seg[i].ip = idup(ip);
+    __sync_fetch_and_add(&ip->nexec, 1);
+  }
   iunlockput(ip);
   end_op();
   ip = 0;
@@ -128,8 +174,16 @@ kexec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  threadkill(p);
+  munmapall(p);
+  aiodrain(p);
+  for(i = 0; i < nseg; i++)
+    p->vma[i] = seg[i];
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->ring = 0;  // freed with the old page table
+  p->cloned = 0;
+  memset(p->asid, 0, sizeof(p->asid));  // new ASIDs for the new page table
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = ulib.c:start()
   p->trapframe->sp = sp; // initial stack pointer
@@ -144,6 +198,14 @@ kexec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  for(i = 0; i < nseg; i++){
+    if(seg[i].ip){
+      __sync_fetch_and_sub(&seg[i].ip->nexec, 1);
+      begin_op();
+      iput(seg[i].ip);
+      end_op();
+    }
+  }
   return -1;
 }
 
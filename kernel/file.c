@@ -10,48 +10,110 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
 #include "stat.h"
 #include "proc.h"
 
+// File structures are kept on per-CPU free lists, so opening
+// and closing files touches no shared lock, and there is no
+// table of them and no limit on how many are open. filealloc()
+// takes one from this CPU's list, or from kmalloc() if the list
+// is empty; fileclose() puts one back, handing half the list
+// back to kmfree() if it is full. When kalloc() runs out of
+// pages it calls filereclaim(), which empties every CPU's list.
+// f->ref is changed with atomic instructions rather than under a
+// lock; the fileclose() that drops it to zero frees f.
+
+#define NFCACHE 16  // free files per CPU
+
+struct fcache {
+  struct spinlock lock;  // only filereclaim() takes it from another CPU
+  int n;
+  struct file *free[NFCACHE];
+};
+
 struct devsw devsw[NDEV];
-struct {
-  struct spinlock lock;
-  struct file file[NFILE];
-} ftable;
+static struct fcache fcache[NCPU];
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&fcache[i].lock, "fcache");
 }
 
 // Allocate a file structure.
 struct file*
 filealloc(void)
 {
+  struct fcache *fc;
+  struct file *f;
+
+  push_off();
+  fc = &fcache[cpuid()];
+  acquire(&fc->lock);
+  f = fc->n > 0 ? fc->free[--fc->n] : 0;
+  release(&fc->lock);
+  pop_off();
+
+  if(f == 0 && (f = kmalloc(sizeof(*f))) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
+}
+
+// Put f on this CPU's free list.
+static void
+filefree(struct file *f)
+{
+  struct fcache *fc;
+  struct file *spill[NFCACHE/2];
+  int i, n = 0;
+
+  push_off();
+  fc = &fcache[cpuid()];
+  acquire(&fc->lock);
+  if(fc->n == NFCACHE){
+    n = NFCACHE/2;
+    fc->n -= n;
+    for(i = 0; i < n; i++)
+      spill[i] = fc->free[fc->n + i];
+  }
+  fc->free[fc->n++] = f;
+  release(&fc->lock);
+  pop_off();
+
+  for(i = 0; i < n; i++)
+    kmfree(spill[i]);
+}
+
+// Give every CPU's free files back to kmfree().
+// Called by kalloc() when it has no free pages.
+void
+filereclaim(void)
+{
+  struct fcache *fc;
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
+  for(fc = fcache; fc < &fcache[NCPU]; fc++){
+    for(;;){
+      acquire(&fc->lock);
+      f = fc->n > 0 ? fc->free[--fc->n] : 0;
+      release(&fc->lock);
+      if(f == 0)
+        break;
+      kmfree(f);
     }
   }
-  release(&ftable.lock);
-  return 0;
 }
 
 // Increment ref count for file f.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__sync_fetch_and_add(&f->ref, 1) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -60,18 +122,14 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int ref;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if((ref = __sync_sub_and_fetch(&f->ref, 1)) < 0)
     panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if(ref > 0)
     return;
-  }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
-  release(&ftable.lock);
+  filefree(f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,80 +159,214 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
-// Read from file f.
-// addr is a user virtual address.
+// Read from file f into the iovcnt user buffers of iov, filling
+// each before going on to the next; from a pipe or device, at
+// most one buffer is filled. If atoff, read from an inode at
+// offset off; otherwise use and advance f->off.
 int
-fileread(struct file *f, uint64 addr, int n)
+filereadv(struct file *f, struct iovec *iov, int iovcnt, int atoff, uint off)
 {
-  int r = 0;
+  int i, r, tot;
+  uint o;
 
   if(f->readable == 0)
     return -1;
+  if(atoff && f->type != FD_INODE)
+    return -1;
 
-  if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
-      return -1;
-    r = devsw[f->major].read(1, addr, n);
-  } else if(f->type == FD_INODE){
+  // copyout() can't read in mmap()ed pages while a lock is held.
+  for(i = 0; i < iovcnt; i++)
+    if(iov[i].iov_len > 0)
+      mmapprefault(myproc()->leader, (uint64)iov[i].iov_base, iov[i].iov_len, 1);
+
+  tot = 0;
+  if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
+    o = atoff ? off : f->off;
+    for(i = 0; i < iovcnt; i++){
+      if((r = readi(f->ip, 1, (uint64)iov[i].iov_base, o, iov[i].iov_len)) < 0){
+        tot = -1;
+        break;
+      }
+      o += r;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
+    if(!atoff)
+      f->off = o;
     iunlock(f->ip);
-  } else {
-    panic("fileread");
+    return tot;
   }
 
-  return r;
+  for(i = 0; i < iovcnt; i++){
+    // a pipe or device read may wait for data, so read into
+    // just the first buffer that has room rather than wait again.
+    if(iov[i].iov_len == 0)
+      continue;
+    if(f->type == FD_PIPE){
+      r = piperead(f->pipe, (uint64)iov[i].iov_base, iov[i].iov_len);
+    } else if(f->type == FD_DEVICE){
+      if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+        return -1;
+      r = devsw[f->major].read(1, (uint64)iov[i].iov_base, iov[i].iov_len);
+    } else {
+      panic("fileread");
+    }
+    return r;
+  }
+  return 0;
 }
 
-// Write to file f.
+// Read from file f.
 // addr is a user virtual address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+fileread(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  struct iovec iov;
 
-  if(f->writable == 0)
+  if(n < 0)
     return -1;
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, 0, 0);
+}
 
-  if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
-      return -1;
-    ret = devsw[f->major].write(1, addr, n);
-  } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
+// Write the iovcnt buffers of iov to inode file f from offset
+// *off, advancing *off. The buffers are user addresses if user
+// is 1, otherwise kernel addresses. Each transaction writes a few
+// blocks, to stay within the maximum log transaction size, and
+// takes in as many buffers as fit, so that writing many small
+// records costs one transaction per few blocks, not one each.
+// Returns the number of bytes written, or -1 if not all were.
+static int
+inodewrite(struct file *f, int user, struct iovec *iov, int iovcnt, uint *off)
+{
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int i, n1, r, op, tot;
+  uint done;  // bytes of iov[i] already written
 
+  i = 0;
+  done = 0;
+  tot = 0;
+  while(i < iovcnt){
+    begin_op();
+    ilock(f->ip);
+    for(op = 0; i < iovcnt && op < max; op += r){
+      n1 = iov[i].iov_len - done;
+      if(n1 > max - op)
+        n1 = max - op;
+      if((r = writei(f->ip, user, (uint64)iov[i].iov_base + done, *off, n1)) > 0){
+        *off += r;
+        tot += r;
+      }
       if(r != n1){
         // error from writei
-        break;
+        iunlock(f->ip);
+        end_op();
+        return -1;
+      }
+      if((done += r) == iov[i].iov_len){
+        i++;
+        done = 0;
       }
-      i += r;
     }
-    ret = (i == n ? n : -1);
-  } else {
-    panic("filewrite");
+    iunlock(f->ip);
+    end_op();
+  }
+  return tot;
+}
+
+// Write the iovcnt user buffers of iov to file f, in order.
+// If atoff, write to an inode at offset off; otherwise use and
+// advance f->off.
+int
+filewritev(struct file *f, struct iovec *iov, int iovcnt, int atoff, uint off)
+{
+  int i, r, tot;
+
+  if(f->writable == 0)
+    return -1;
+  if(atoff && f->type != FD_INODE)
+    return -1;
+
+  // copyin() can't read in mmap()ed pages while a lock is held.
+  for(i = 0; i < iovcnt; i++)
+    if(iov[i].iov_len > 0)
+      mmapprefault(myproc()->leader, (uint64)iov[i].iov_base, iov[i].iov_len, 0);
+
+  if(f->type == FD_INODE)
+    return inodewrite(f, 1, iov, iovcnt, atoff ? &off : &f->off);
+
+  tot = 0;
+  for(i = 0; i < iovcnt; i++){
+    if(f->type == FD_PIPE){
+      r = pipewrite(f->pipe, (uint64)iov[i].iov_base, iov[i].iov_len);
+    } else if(f->type == FD_DEVICE){
+      if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+        return -1;
+      r = devsw[f->major].write(1, (uint64)iov[i].iov_base, iov[i].iov_len);
+    } else {
+      panic("filewrite");
+    }
+    if(r < 0)
+      return -1;
+    tot += r;
+    if(r < iov[i].iov_len)
+      break;
   }
+  return tot;
+}
 
-  return ret;
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  struct iovec iov;
+
+  if(n < 0)
+    return -1;
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, 0, 0);
 }
 
+// Read or write n bytes of inode file f at offset off, to or
+// from kernel buffer buf, for aio.c. f->off is left alone.
+// Returns the number of bytes moved, or -1.
+int
+fileio(struct file *f, int write, char *buf, int n, uint off)
+{
+  struct iovec iov;
+  int r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  if(write){
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    return inodewrite(f, 0, &iov, 1, &off);
+  }
+  ilock(f->ip);
+  r = readi(f->ip, 0, (uint64)buf, off, n);
+  iunlock(f->ip);
+  return r;
+}
+
+// Move up to n bytes from file in to file out without copying
+// them through user space. One of the two must be a pipe and
+// the other an inode.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_INODE && out->type == FD_PIPE)
+    return pipesplicein(out->pipe, in, n);
+  if(in->type == FD_PIPE && out->type == FD_INODE)
+    return pipespliceout(in->pipe, out, n);
+  return -1;
+}
@@ -18,6 +18,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int nexec;          // program segments mapping it; no writes (see mmap.c)
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,6 +28,23 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint prealloc;      // next block of the preallocation window (see fs.c)
+  uint nprealloc;     // blocks left in the window
+  uint nclaimed;      // of those, already marked in use by writei()
+  int pcached;        // may have pages in pcache.c
+
+  struct inode *hnext;  // inode table hash chain (see fs.c)
+  struct inode *lnext;  // LRU list of unreferenced inodes
+  struct inode *lprev;
+};
+
+// walks a directory's entries in place, a block at a time (see fs.c).
+struct diriter {
+  struct inode *dp;
+  uint off;           // offset of the entry dirnext() returned last
+  uint next;          // offset of the entry it returns next
+  struct buf *bp;     // block holding them, or 0
 };
 
 // map major device number to device functions.
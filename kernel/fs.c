@@ -61,33 +61,97 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+// Where balloc() starts looking when the caller has no better
+// idea: just past the most recently allocated block. It is only
+// a hint, so unlocked updates are harmless.
+static uint bcursor;
+
+// Index of the lowest clear bit in w, which must not be all ones.
+static int
+firstzero(uint64 w)
+{
+  int i = 0;
+
+  w = ~w;
+  if((w & 0xffffffff) == 0){ w >>= 32; i += 32; }
+  if((w & 0xffff) == 0){ w >>= 16; i += 16; }
+  if((w & 0xff) == 0){ w >>= 8; i += 8; }
+  if((w & 0xf) == 0){ w >>= 4; i += 4; }
+  if((w & 0x3) == 0){ w >>= 2; i += 2; }
+  if((w & 0x1) == 0)
+    i += 1;
+  return i;
+}
+
+// Find the first free block in [from, to) and mark it in use,
+// along with up to n-1 free blocks directly after it; the run
+// stops at a block in use, at the end of the bitmap block, or
+// at the end of the disk. Sets *got to the length of the run.
+// The bitmap is examined 64 bits at a time; on a little-endian
+// machine bit i of word w is the bit for block 64*w + i, the same
+// layout mkfs writes a byte at a time.
+// Returns the first block number, or 0 if there is no free block
+// in the range (block 0 is the boot block, never free).
 static uint
-balloc(uint dev)
+bscan(uint dev, uint from, uint to, uint n, uint *got)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint64 *map, w;
+  uint b, bi, end, i;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  for(b = from - from % BPB; b < to; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+    map = (uint64*)bp->data;
+    bi = (b < from) ? from - b : 0;
+    end = (to - b < BPB) ? to - b : BPB;
+    while(bi < end){
+      w = map[bi/64] | (((uint64)1 << (bi%64)) - 1); // skip bits below bi
+      if(w != ~(uint64)0){
+        bi = bi - bi%64 + firstzero(w);
+        if(bi >= end)
+          break;
+        // Mark blocks in use.
+        for(i = bi; i < bi + n && i < BPB && b + i < sb.size; i++){
+          if(map[i/64] & ((uint64)1 << (i%64)))
+            break;
+          map[i/64] |= (uint64)1 << (i%64);
+        }
+        *got = i - bi;
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
         return b + bi;
       }
+      bi = bi - bi%64 + 64;
     }
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate a disk block, preferably the first free block at
+// or after goal, so that a file's blocks stay contiguous.
+// goal == 0 means no preference. The block's contents are
+// whatever was left on disk; the caller must zero or
+// overwrite it.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, got;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bcursor;
+  if(goal >= sb.size)
+    goal = 0;
+  if((b = bscan(dev, goal, sb.size, 1, &got)) == 0 &&
+     (b = bscan(dev, 0, goal, 1, &got)) == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  bcursor = b + 1;
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -140,8 +204,8 @@ bfree(int dev, uint b)
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid, while iget() clears
+//   ip->valid when it recycles a table entry.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -165,29 +229,64 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The inode table is a hash table of NIHASH buckets, each a
+// chain of inodes with its own spin-lock, so that processes
+// using different files don't contend. Entries are allocated
+// with kmalloc() as needed. An entry whose ref has fallen to
+// zero stays in its chain, still valid, in case the inode is
+// wanted again, and goes on the itable.lru list; once the table
+// has NINODE entries, iget() recycles the least recently used
+// of these instead of allocating more. So the table holds every
+// inode in use, however many, plus a cache of recent ones. When
+// more than NINODE inodes have been in use at once, iput() frees
+// unused entries with kmfree() until the table is back to NINODE.
+//
+// A bucket's lock protects its chain and the ref, dev, and inum
+// of the inodes on it. itable.lock protects the LRU list and
+// ninode, and is held by iget() while it adds an inode to the
+// table and by iput() while it frees entries, so at most one
+// process at a time holds two bucket locks. itable.lock must be
+// acquired before any bucket lock. The LRU list is maintained
+// lazily: iget() doesn't take a revived inode off it, and the
+// recycler skips inodes whose ref is non-zero.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
-// read or write that inode's ip->valid, ip->size, ip->type, &c.
+// dev, inum, and the table links. One must hold ip->lock in order
+// to read or write that inode's ip->valid, ip->size, ip->type, &c.
+
+#define NIHASH 31
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode *head;
+};
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode lru;       // unreferenced inodes, least recent first
+  int ninode;             // entries allocated
+  struct ibucket bucket[NIHASH];
 } itable;
 
+static void dcacheinit(void);
+static void dcachepurge(struct inode*);
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  for(i = 0; i < NIHASH; i++)
+    initlock(&itable.bucket[i].lock, "ibucket");
+  dcacheinit();
+}
+
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &itable.bucket[(dev * 7 + inum) % NIHASH];
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -241,37 +340,139 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// Take ip off the LRU list, if it is on it.
+// Caller must hold itable.lock.
+static void
+lruremove(struct inode *ip)
+{
+  if(ip->lnext == 0)
+    return;
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  ip->lnext = ip->lprev = 0;
+}
+
+// Return the inode in chain b for (dev, inum), or 0.
+// Caller must hold b->lock.
+static struct inode*
+ifind(struct ibucket *b, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = b->head; ip; ip = ip->hnext)
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  return 0;
+}
+
+// Free unused entries, least recently used first, until the
+// table has no more than NINODE. Caller must hold itable.lock.
+static void
+ishrink(void)
+{
+  struct inode *ip, *next, **pp;
+  struct ibucket *b;
+
+  for(ip = itable.lru.lnext; ip != &itable.lru && itable.ninode > NINODE; ip = next){
+    next = ip->lnext;
+    lruremove(ip);
+    b = ihash(ip->dev, ip->inum);
+    acquire(&b->lock);
+    if(ip->ref > 0){
+      // in use again; iput() will put it back on the list.
+      release(&b->lock);
+      continue;
+    }
+    for(pp = &b->head; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+    release(&b->lock);
+    if(ip->pcached)
+      pcacheinval(ip);
+    itable.ninode--;
+    kmfree(ip);
+  }
+}
+
+// Find a table entry for iget() to fill in: the least recently
+// used unreferenced inode, taken out of its chain, or a new one.
+// Caller must hold itable.lock and b->lock, the bucket the
+// entry is for. Returns 0 if out of memory.
+static struct inode*
+irecycle(struct ibucket *b)
+{
+  struct inode *ip, *next, **pp;
+  struct ibucket *vb;
+
+  if(itable.ninode >= NINODE){
+    for(ip = itable.lru.lnext; ip != &itable.lru; ip = next){
+      next = ip->lnext;
+      lruremove(ip);
+      vb = ihash(ip->dev, ip->inum);
+      if(vb != b)
+        acquire(&vb->lock);
+      if(ip->ref == 0){
+        for(pp = &vb->head; *pp != ip; pp = &(*pp)->hnext)
+          ;
+        *pp = ip->hnext;
+        if(vb != b)
+          release(&vb->lock);
+        // a reused inode number mustn't find the old pages.
+        if(ip->pcached)
+          pcacheinval(ip);
+        return ip;
+      }
+      // in use again; iput() will put it back on the list.
+      if(vb != b)
+        release(&vb->lock);
+    }
+  }
+
+  if((ip = kmalloc(sizeof(*ip))) == 0)
+    return 0;
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
+  itable.ninode++;
+  return ip;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct ibucket *b = ihash(dev, inum);
+  struct inode *ip;
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&b->lock);
+  if((ip = ifind(b, dev, inum)) != 0){
+    ip->ref++;
+    release(&b->lock);
+    return ip;
   }
+  release(&b->lock);
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
+  // No; look again holding itable.lock, in case another
+  // process has added it meanwhile.
+  acquire(&itable.lock);
+  acquire(&b->lock);
+  if((ip = ifind(b, dev, inum)) != 0){
+    ip->ref++;
+  } else {
+    if((ip = irecycle(b)) == 0)
+      panic("iget: no inodes");
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->nprealloc = 0;
+    ip->nclaimed = 0;
+    ip->hnext = b->head;
+    b->head = ip;
+  }
+  release(&b->lock);
   release(&itable.lock);
 
   return ip;
@@ -282,9 +483,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = ihash(ip->dev, ip->inum);
+
+  acquire(&b->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&b->lock);
   return ip;
 }
 
@@ -329,7 +532,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, and the file's preallocation window is released.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -337,7 +540,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *b = ihash(ip->dev, ip->inum);
+
+  acquire(&b->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -346,8 +551,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&b->lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -355,10 +562,32 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&b->lock);
   }
 
-  ip->ref--;
+  if(ip->ref > 1){
+    ip->ref--;
+    release(&b->lock);
+    return;
+  }
+  release(&b->lock);
+
+  // the last reference, maybe: drop it holding itable.lock, so
+  // that ishrink() can't free ip before it is on the LRU list.
+  acquire(&itable.lock);
+  acquire(&b->lock);
+  if(--ip->ref == 0){
+    ip->nprealloc = 0;
+    // most recently used goes at the end.
+    lruremove(ip);
+    ip->lprev = itable.lru.lprev;
+    ip->lnext = &itable.lru;
+    itable.lru.lprev->lnext = ip;
+    itable.lru.lprev = ip;
+  }
+  release(&b->lock);
+  if(itable.ninode > NINODE)
+    ishrink();
   release(&itable.lock);
 }
 
@@ -398,22 +627,121 @@ ireclaim(int dev)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// A growing file keeps a preallocation window of up to PREALLOC
+// blocks, ip->nprealloc blocks starting at ip->prealloc, from
+// which bmap() takes new blocks in order, so that a file extended
+// by many small writes, perhaps interleaved with other files'
+// writes, still ends up contiguous on disk. The window lives only
+// in memory: its blocks are not marked in the bitmap until the
+// file uses them, and if another file takes one first the window
+// is abandoned. Dropping the window, as iput() and itrunc() do,
+// therefore releases it without touching the disk, and a crash
+// cannot leak it.
+//
+// writei() marks all the blocks an append will add in one bitmap
+// update, with iclaim(). ip->nclaimed counts claimed blocks at the
+// front of the window that bmap() has not yet handed out; writei()
+// frees any left over (after a failed copy) before it returns, in
+// the same transaction.
+
+static uint bmap(struct inode *ip, uint bn, int *fresh);
+
+// Claim n blocks at the front of ip's preallocation window,
+// opening a new window just past the file's last block if ip
+// has none. May claim fewer than n; bmap() then falls back to
+// balloc() for the rest.
+// Caller must hold ip->lock.
+static void
+iclaim(struct inode *ip, uint n)
+{
+  uint b, got, goal;
+
+  if(ip->nprealloc > 0){
+    if(n > ip->nprealloc)
+      n = ip->nprealloc;
+    if(bscan(ip->dev, ip->prealloc, ip->prealloc + 1, n, &got) != 0){
+      ip->nclaimed = got;
+      if(got < n)
+        ip->nprealloc = got;  // the rest of the window was taken.
+      return;
+    }
+    ip->nprealloc = 0;
+  }
+
+  goal = 0;
+  if(ip->size > 0 && (b = bmap(ip, (ip->size - 1) / BSIZE, 0)) != 0)
+    goal = b + 1;
+  if(goal == 0 || goal >= sb.size)
+    goal = bcursor;
+  if(goal >= sb.size)
+    goal = 0;
+  if((b = bscan(ip->dev, goal, sb.size, n, &got)) == 0 &&
+     (b = bscan(ip->dev, 0, goal, n, &got)) == 0)
+    return;
+
+  ip->prealloc = b;
+  ip->nclaimed = got;
+  if(got < n)
+    ip->nprealloc = got;
+  else
+    ip->nprealloc = (n > PREALLOC) ? n : PREALLOC;
+  if(ip->nprealloc > sb.size - b)
+    ip->nprealloc = sb.size - b;
+  // steer other files' allocations past the window.
+  bcursor = b + ip->nprealloc;
+}
+
+// Allocate a block for ip, from its preallocation window if
+// it has one, else preferably at or after goal. Zero the
+// block if zero is set.
+// returns 0 if out of disk space.
+// Caller must hold ip->lock.
+static uint
+ibnew(struct inode *ip, uint goal, int zero)
+{
+  uint b, got;
+
+  if(ip->nprealloc > 0 &&
+     (ip->nclaimed > 0 ||
+      bscan(ip->dev, ip->prealloc, ip->prealloc + 1, 1, &got) != 0)){
+    b = ip->prealloc++;
+    ip->nprealloc--;
+    if(ip->nclaimed > 0)
+      ip->nclaimed--;
+  } else {
+    ip->nprealloc = 0;
+    if((b = balloc(ip->dev, goal)) == 0)
+      return 0;
+  }
+  if(zero)
+    bzero(ip->dev, b);
+  return b;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, trying to
+// place it right after the file's previous block, and zeroes
+// it. A caller that will overwrite the whole block passes a
+// non-zero fresh: then a new block is not zeroed, and *fresh
+// is set to 1 to say that there is nothing on disk worth
+// reading.
 // returns 0 if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int *fresh)
 {
-  uint addr, *a;
+  uint addr, *a, goal;
   struct buf *bp;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      goal = (bn > 0 && ip->addrs[bn-1]) ? ip->addrs[bn-1] + 1 : 0;
+      addr = ibnew(ip, goal, fresh == 0);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
+      if(fresh)
+        *fresh = 1;
     }
     return addr;
   }
@@ -422,7 +750,8 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      goal = ip->addrs[NDIRECT-1] ? ip->addrs[NDIRECT-1] + 1 : 0;
+      addr = ibnew(ip, goal, 1);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -430,10 +759,16 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      if(bn > 0 && a[bn-1])
+        goal = a[bn-1] + 1;
+      else
+        goal = ip->addrs[NDIRECT] + 1;
+      addr = ibnew(ip, goal, fresh == 0);
       if(addr){
         a[bn] = addr;
         log_write(bp);
+        if(fresh)
+          *fresh = 1;
       }
     }
     brelse(bp);
@@ -452,6 +787,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->pcached)
+    pcacheinval(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -472,6 +809,7 @@ itrunc(struct inode *ip)
   }
 
   ip->size = 0;
+  ip->nprealloc = 0;
   iupdate(ip);
 }
 
@@ -496,6 +834,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  uint64 pa;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -503,11 +843,21 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    m = min(n - tot, BSIZE - off%BSIZE);
+    // a MAP_SHARED page may be newer than the disk.
+    if(ip->pcached && (pa = pcacheshared(ip, off)) != 0){
+      r = either_copyout(user_dst, dst, (char*)pa + off % PGSIZE, m);
+      kfree((void*)pa);
+      if(r == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    uint addr = bmap(ip, off/BSIZE, 0);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -535,21 +885,53 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // a running program, not all of which may be read in yet.
+  if(ip->nexec > 0)
+    return -1;
+
+  // Claim the blocks this write will add, in one bitmap update.
+  if(off + n > ip->size){
+    uint have = (ip->size + BSIZE - 1) / BSIZE;
+    uint need = (off + n + BSIZE - 1) / BSIZE;
+    if(have <= NDIRECT && need > NDIRECT && ip->addrs[NDIRECT] == 0)
+      need++;  // the indirect block
+    if(need > have)
+      iclaim(ip, need - have);
+  }
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    // a whole new block needs neither zeroing nor reading.
+    int fresh = 0;
+    int whole = off % BSIZE == 0 && n - tot >= BSIZE;
+    uint addr = bmap(ip, off/BSIZE, whole ? &fresh : 0);
     if(addr == 0)
       break;
-    bp = bread(ip->dev, addr);
+    if(fresh)
+      bp = bcreate(ip->dev, addr);
+    else
+      bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+      if(fresh){
+        // don't leave another file's old data in the block.
+        memset(bp->data, 0, BSIZE);
+        log_write(bp);
+      }
       brelse(bp);
       break;
     }
     log_write(bp);
+    if(ip->pcached)
+      pcachewrite(ip, off, (char*)bp->data + (off % BSIZE), m);
     brelse(bp);
   }
 
+  // Give back blocks claimed for this write but not used;
+  // they stay at the front of the preallocation window.
+  for(uint i = 0; i < ip->nclaimed; i++)
+    bfree(ip->dev, ip->prealloc + i);
+  ip->nclaimed = 0;
+
   if(off > ip->size)
     ip->size = off;
 
@@ -569,31 +951,207 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache. dirlookup() remembers the outcome of
+// each search by (device, directory inode number, name): the
+// inode number and offset of the entry, or that there is none
+// (inum 0). A directory's entries only change while it is
+// locked, and it is locked for lookups too, so the cache stays
+// right as long as dirlink() and unlink record their changes
+// here with dcacheput(); iput() drops a directory's names when
+// it frees the directory. Each name hashes to a set of DCWAYS
+// entries, replaced in turn.
+
+#define DCWAYS 4
+#define NDCSET (NDCACHE/DCWAYS)
+
+struct dcent {
+  uint dev;
+  uint dinum;     // directory; 0 if the entry is unused
+  uint inum;      // 0 if there is no such name
+  uint off;
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  struct dcent ent[NDCSET][DCWAYS];
+  uint next[NDCSET];  // way to replace next in each set
+} dcache;
+
+static void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+// The set that name in dp belongs to.
+static uint
+dchash(struct inode *dp, char *name)
+{
+  uint h = dp->dev * 31 + dp->inum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDCSET;
+}
+
+// Return dp's entry for name in set, or 0.
+// Caller must hold dcache.lock.
+static struct dcent*
+dcfind(struct dcent *set, struct inode *dp, char *name)
+{
+  struct dcent *e;
+
+  for(e = set; e < &set[DCWAYS]; e++)
+    if(e->dinum == dp->inum && e->dev == dp->dev && namecmp(name, e->name) == 0)
+      return e;
+  return 0;
+}
+
+// Look name up in the cache. Returns 1, setting *inum and *off,
+// if the answer is known, else 0.
+static int
+dcachelookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dcent *e;
+  int found = 0;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dcache.ent[dchash(dp, name)], dp, name)) != 0){
+    *inum = e->inum;
+    *off = e->off;
+    found = 1;
+  }
+  release(&dcache.lock);
+  return found;
+}
+
+// Record that name in directory dp is inode inum, in the entry
+// at offset off, or, if inum is 0, that there is no such name.
+// Caller must hold dp's lock.
+void
+dcacheput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dcent *e;
+  uint s;
+
+  acquire(&dcache.lock);
+  s = dchash(dp, name);
+  if((e = dcfind(dcache.ent[s], dp, name)) == 0){
+    e = &dcache.ent[s][dcache.next[s]];
+    dcache.next[s] = (dcache.next[s] + 1) % DCWAYS;
+    e->dev = dp->dev;
+    e->dinum = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+  }
+  e->inum = inum;
+  e->off = off;
+  release(&dcache.lock);
+}
+
+// Forget the cached names in directory dp.
+static void
+dcachepurge(struct inode *dp)
+{
+  struct dcent *e;
+
+  acquire(&dcache.lock);
+  for(int s = 0; s < NDCSET; s++)
+    for(e = dcache.ent[s]; e < &dcache.ent[s][DCWAYS]; e++)
+      if(e->dinum == dp->inum && e->dev == dp->dev)
+        e->dinum = 0;
+  release(&dcache.lock);
+}
+
+// Iterate over the entries of directory dp from byte offset off:
+//
+//   diropen(&it, dp, off);
+//   while((de = dirnext(&it)) != 0)
+//     ... de is the entry at it.off ...
+//   dirclose(&it);
+//
+// dirnext() returns a pointer into the buffer cache, so each
+// block is read once and its entries aren't copied; the pointer
+// is good until the next call. The caller must hold dp->lock
+// and must not write the directory before dirclose().
+void
+diropen(struct diriter *it, struct inode *dp, uint off)
+{
+  it->dp = dp;
+  it->off = off;
+  it->next = off;
+  it->bp = 0;
+}
+
+struct dirent*
+dirnext(struct diriter *it)
+{
+  struct inode *dp = it->dp;
+  uint addr;
+
+  if(it->bp && it->next % BSIZE == 0){
+    brelse(it->bp);
+    it->bp = 0;
+  }
+  if(it->next + sizeof(struct dirent) > dp->size){
+    dirclose(it);
+    return 0;
+  }
+  if(it->bp == 0){
+    if((addr = bmap(dp, it->next / BSIZE, 0)) == 0)
+      panic("dirnext");
+    it->bp = bread(dp->dev, addr);
+  }
+  it->off = it->next;
+  it->next += sizeof(struct dirent);
+  return (struct dirent*)(it->bp->data + it->off % BSIZE);
+}
+
+void
+dirclose(struct diriter *it)
+{
+  if(it->bp){
+    brelse(it->bp);
+    it->bp = 0;
+  }
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
-  struct dirent de;
+  struct diriter it;
+  struct dirent *de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
+  if(dcachelookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  diropen(&it, dp, 0);
+  while((de = dirnext(&it)) != 0){
+    if(de->inum == 0)
       continue;
-    if(namecmp(name, de.name) == 0){
+    if(namecmp(name, de->name) == 0){
       // entry matches path element
       if(poff)
-        *poff = off;
-      inum = de.inum;
+        *poff = it.off;
+      inum = de->inum;
+      dirclose(&it);
+      dcacheput(dp, name, inum, it.off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheput(dp, name, 0, 0);
   return 0;
 }
 
@@ -602,8 +1160,9 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
-  struct dirent de;
+  uint off;
+  struct diriter it;
+  struct dirent de, *e;
   struct inode *ip;
 
   // Check that name is not present.
@@ -612,18 +1171,22 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
+  // Look for an empty dirent, else append.
+  off = dp->size;
+  diropen(&it, dp, 0);
+  while((e = dirnext(&it)) != 0){
+    if(e->inum == 0){
+      off = it.off;
       break;
+    }
   }
+  dirclose(&it);
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcacheput(dp, name, inum, off);
 
   return 0;
 }
@@ -679,7 +1242,7 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(myproc()->leader->cwd);
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
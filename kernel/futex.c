@@ -0,0 +1,161 @@
+//
+// Futexes, for user-space locks that sleep instead of spinning
+// (see ulib.c). A lock or condition lives in an int of user
+// memory that threads change with atomic instructions, and they
+// only enter the kernel to wait for it to change or to wake the
+// waiters after changing it.
+//
+// Waiters are keyed by the int's physical address, so the threads
+// of a process meet there, as do processes that share the page
+// through a MAP_SHARED region. A key hashes to one of NFHASH
+// buckets, each a list of its waiters, oldest first, under a lock
+// of its own. futexwait() checks the int under the bucket's lock,
+// which futexwake() also holds, so a wakeup by a thread that has
+// just changed the int can't be missed; futexwake() takes waiters
+// off the list in order and wakes just them, without looking at
+// any other process.
+//
+// A waiter blocks in sleep(), as a process waiting for the disk or
+// a pipe does, so the MLFQ treats it the same way: it is charged
+// only for the ticks it runs, keeps its queue level while it
+// waits, and is queued at that level when woken.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NFHASH 31
+
+struct fbucket {
+  struct spinlock lock;
+  struct proc *head;     // waiters, oldest first, through fnext
+  struct proc *tail;
+};
+
+struct {
+  struct fbucket bucket[NFHASH];
+} futex;
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFHASH; i++)
+    initlock(&futex.bucket[i].lock, "futex");
+}
+
+static struct fbucket*
+fhash(uint64 key)
+{
+  return &futex.bucket[(key / sizeof(int)) % NFHASH];
+}
+
+// Take p, which follows prev (or is first, if prev is 0), off
+// b's list. Caller must hold b->lock.
+static void
+fremove(struct fbucket *b, struct proc *prev, struct proc *p)
+{
+  if(prev)
+    prev->fnext = p->fnext;
+  else
+    b->head = p->fnext;
+  if(b->tail == p)
+    b->tail = prev;
+  p->fnext = 0;
+  p->fkey = 0;
+}
+
+// The physical address of the int at user address addr in p,
+// faulting its page in.
+// Returns 0 if addr isn't a valid, aligned user address.
+static uint64
+futexaddr(struct proc *p, uint64 addr)
+{
+  uint64 pa;
+  int x;
+
+  if(addr % sizeof(int) != 0)
+    return 0;
+  if(copyin(p->pagetable, (char*)&x, addr, sizeof(x)) < 0)
+    return 0;
+  if((pa = walkaddr(p->pagetable, addr)) == 0)
+    return 0;
+  return pa + (addr % PGSIZE);
+}
+
+// Sleep until woken by futexwake(), if the int at addr holds val.
+// Returns 0, or -1 if addr is bad or the caller has been killed.
+int
+futexwait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  struct proc *pp, *prev;
+  struct fbucket *b;
+  uint64 key;
+
+  if((key = futexaddr(p, addr)) == 0)
+    return -1;
+  b = fhash(key);
+  acquire(&b->lock);
+  if(*(volatile int*)key == val && !killed(p)){
+    p->fkey = key;
+    p->fnext = 0;
+    if(b->tail)
+      b->tail->fnext = p;
+    else
+      b->head = p;
+    b->tail = p;
+    // futexwake() takes p off the list; kill() just wakes it.
+    while(p->fkey != 0 && !killed(p))
+      sleep(&p->fkey, &b->lock);
+    if(p->fkey != 0){
+      prev = 0;
+      for(pp = b->head; pp != p; pp = pp->fnext)
+        prev = pp;
+      fremove(b, prev, p);
+    }
+  }
+  release(&b->lock);
+  return killed(p) ? -1 : 0;
+}
+
+// Wake up to n of the threads waiting in futexwait() on addr,
+// longest waiting first.
+// Returns how many were woken, or -1 if addr is bad.
+int
+futexwake(uint64 addr, int n)
+{
+  struct proc *pp, *prev, *next;
+  struct fbucket *b;
+  uint64 key;
+  int woken = 0;
+
+  if((key = futexaddr(myproc(), addr)) == 0)
+    return -1;
+  b = fhash(key);
+  acquire(&b->lock);
+  prev = 0;
+  for(pp = b->head; pp != 0 && woken < n; pp = next){
+    next = pp->fnext;
+    if(pp->fkey != key){
+      prev = pp;
+      continue;
+    }
+    fremove(b, prev, pp);
+    acquire(&pp->lock);
+    if(pp->state == SLEEPING && pp->chan == &pp->fkey){
+      pp->state = RUNNABLE;
+      enqueue(pp);  // at the level it slept at
+    }
+    release(&pp->lock);
+    woken++;
+  }
+  release(&b->lock);
+  return woken;
+}
@@ -1,6 +1,22 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and slab.c's small-object slabs. Allocates whole 4096-byte pages.
+//
+// Each page has a reference count, so that a page can be mapped
+// by several processes (see pcache.c and uvmcopy()). kalloc()
+// returns a page with one reference, kdup() adds one, and
+// kfree() drops one, freeing the page when none are left.
+//
+// The top NMEGA megapages of RAM (2 megabytes each, aligned) are
+// kept apart for kallocmega(), which backs large heaps (see
+// uvmallocmega()). kallocmega() hands out all 512 pages of one at
+// once, each with its own reference, so they can later be freed
+// one at a time, e.g. after a megapage mapping has been split.
+// The free pages of a megapage that is out of the pool are kept
+// on its own list, kmem.megafree[], and once all 512 are free
+// again the megapage goes back to the pool. When the free list
+// runs dry, kalloc() takes pages from those lists, and then
+// from the pool, so no memory is kept from ordinary use.
 
 #include "types.h"
 #include "param.h"
@@ -18,16 +34,32 @@ struct run {
   struct run *next;
 };
 
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define MEGABASE (PHYSTOP - NMEGA*MEGASIZE)
+#define PA2MEGA(pa) (((uint64)(pa) - MEGABASE) / MEGASIZE)
+
 struct {
   struct spinlock lock;
   struct run *freelist;
+  struct run *megalist;      // free megapages
+  int ref[PA2REF(PHYSTOP)];  // protected by lock
+  struct run *megafree[NMEGA];  // free pages of each megapage out of the pool
+  int nfree[NMEGA];          // how many
 } kmem;
 
 void
 kinit()
 {
+  struct run *r;
+  uint64 pa;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  freerange(end, (void*)MEGABASE);
+  for(pa = MEGABASE; pa < PHYSTOP; pa += MEGASIZE){
+    r = (struct run*)pa;
+    r->next = kmem.megalist;
+    kmem.megalist = r;
+  }
 }
 
 void
@@ -35,38 +67,110 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2REF(p)] = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(void *pa)
 {
   struct run *r;
+  int ref, m;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  acquire(&kmem.lock);
+  if(kmem.ref[PA2REF(pa)] < 1)
+    panic("kfree: ref");
+  ref = --kmem.ref[PA2REF(pa)];
+  release(&kmem.lock);
+  if(ref > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
-
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  if((uint64)pa >= MEGABASE){
+    m = PA2MEGA(pa);
+    r->next = kmem.megafree[m];
+    kmem.megafree[m] = r;
+    if(++kmem.nfree[m] == MEGASIZE/PGSIZE){
+      // the whole megapage is free again.
+      kmem.megafree[m] = 0;
+      kmem.nfree[m] = 0;
+      r = (struct run*)MEGAROUNDDOWN((uint64)pa);
+      r->next = kmem.megalist;
+      kmem.megalist = r;
+    }
+  } else {
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+  }
   release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
+// If none is free, have file.c and slab.c give back the
+// pages they can spare and try again.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  void *pa;
+
+  if((pa = kallocnoreclaim()) == 0){
+    filereclaim();
+    if(kmreclaim() > 0)
+      pa = kallocnoreclaim();
+  }
+  return pa;
+}
+
+// The free list is empty: take a free page of a megapage that is
+// out of the pool, or else break up a megapage from the pool.
+// Caller holds kmem.lock.
+static struct run*
+kallocfrommega(void)
+{
+  struct run *r;
+  uint64 pa;
+  int m;
+
+  for(m = 0; m < NMEGA; m++)
+    if(kmem.megafree[m])
+      break;
+  if(m == NMEGA){
+    if((r = kmem.megalist) == 0)
+      return 0;
+    kmem.megalist = r->next;
+    m = PA2MEGA(r);
+    for(pa = (uint64)r; pa < (uint64)r + MEGASIZE; pa += PGSIZE){
+      ((struct run*)pa)->next = kmem.megafree[m];
+      kmem.megafree[m] = (struct run*)pa;
+    }
+    kmem.nfree[m] = MEGASIZE/PGSIZE;
+  }
+  r = kmem.megafree[m];
+  kmem.megafree[m] = r->next;
+  kmem.nfree[m]--;
+  return r;
+}
+
+// kalloc() for slab.c, which calls it holding locks
+// that kmreclaim() takes.
+void *
+kallocnoreclaim(void)
 {
   struct run *r;
 
@@ -74,9 +178,63 @@ kalloc(void)
   r = kmem.freelist;
   if(r)
     kmem.freelist = r->next;
+  else
+    r = kallocfrommega();
+  if(r)
+    kmem.ref[PA2REF(r)] = 1;
   release(&kmem.lock);
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Allocate one megapage: MEGASIZE bytes of physical memory,
+// aligned to MEGASIZE, from the pool. Each of its pages has
+// one reference and is freed with kfree().
+// Returns 0 if the pool is empty.
+void *
+kallocmega(void)
+{
+  struct run *r;
+  uint64 pa;
+
+  acquire(&kmem.lock);
+  r = kmem.megalist;
+  if(r){
+    kmem.megalist = r->next;
+    for(pa = (uint64)r; pa < (uint64)r + MEGASIZE; pa += PGSIZE)
+      kmem.ref[PA2REF(pa)] = 1;
+  }
+  release(&kmem.lock);
+
+  if(r)
+    memset((char*)r, 5, MEGASIZE); // fill with junk
+  return (void*)r;
+}
+
+// The number of references to the allocated page pa.
+int
+krefs(void *pa)
+{
+  int n;
+
+  acquire(&kmem.lock);
+  n = kmem.ref[PA2REF(pa)];
+  release(&kmem.lock);
+  return n;
+}
+
+// Add a reference to the allocated page pa.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  acquire(&kmem.lock);
+  if(kmem.ref[PA2REF(pa)] < 1)
+    panic("kdup: ref");
+  kmem.ref[PA2REF(pa)]++;
+  release(&kmem.lock);
+}
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    kminit();        // small-object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -26,9 +27,12 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
-    fileinit();      // file table
+    fileinit();      // file structures
+    pcacheinit();    // shared read-only file pages
+    futexinit();     // user-space lock wait queues
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    aioinit();       // asynchronous I/O threads
     __sync_synchronize();
     started = 1;
   } else {
@@ -54,6 +54,13 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed regions, allocated downwards from MMAPTOP, RING,
+//     or THREADTF(NTHREAD-1)
+//   THREADTF(i) (clone()d threads' trapframes, once there are any)
+//   RING (the ringsetup() page, if there is one)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define RING (TRAPFRAME - PGSIZE)
+#define THREADTF(i) (RING - ((uint64)(i)+1)*PGSIZE)
+#define MMAPTOP TRAPFRAME
@@ -0,0 +1,376 @@
+//
+// Memory-mapped files: mmap() and munmap(), and demand-paged
+// program segments for exec().
+//
+// Each process has up to NVMA file-backed regions, p->vma[].
+// mmap() places regions top-down from MMAPTOP, below the
+// trapframe, or from RING if the process has a ring page, or
+// below the threads' trapframes if it has clone()d, and the heap
+// may grow up to the lowest of them. Threads share the leader's
+// regions; mmap() adds to them under the leader's tlock.
+// exec() records each program segment as a VMA_SEGMENT region
+// inside p->sz instead of reading it in. While any process runs
+// a program this way, ip->nexec counts its segments and the file
+// can't be written, opened for writing or truncated, so a page
+// read in late can't come from a newer version. Nothing is read when a
+// region is created: a page fault in a region reads the page from
+// the file through the buffer cache (mmapfault(), called from
+// vmfault()); pages of regions that can't be written come from
+// pcache.c, shared with any other process that maps them, so
+// processes running the same program share its text. The pages
+// of MAP_SHARED regions come from pcache.c too, one copy of each
+// for all processes that map it, which read() and write() also
+// use, so all of them see each other's changes at once. When a
+// MAP_SHARED page that the process, or the kernel through
+// copyout(), has written (PTE_D) is unmapped, it is written
+// back to the file through the log.
+// Writes past the end of the file are not written back; mmap()
+// never changes a file's size. If every pcache.c entry holds a
+// mapped shared page, a fault on another one fails.
+//
+// Reading a page in may sleep, so mmapfault() refuses to run with
+// interrupts off, e.g. while copyin() or copyout() is called with
+// a spinlock held. fileread() and filewrite() fault in any mapped
+// pages of the user's buffer before they take such locks.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Return the region that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address of any mapped region; the heap must stay below.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = p->ring ? RING : MMAPTOP;
+
+  if(p->cloned)
+    base = THREADTF(NTHREAD-1);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && (v->flags & VMA_SEGMENT) == 0 && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0)
+      return v;
+  return 0;
+}
+
+// Release v's inode and free the slot.
+static void
+vmadrop(struct vma *v)
+{
+  if(v->flags & VMA_SEGMENT)
+    __sync_fetch_and_sub(&v->ip->nexec, 1);
+  begin_op();
+  iput(v->ip);
+  end_op();
+  v->ip = 0;
+  v->len = 0;
+}
+
+// Map len bytes of file f, starting at offset off, into the
+// current process. Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, int off)
+{
+  struct proc *p = myproc()->leader;
+  struct vma *v;
+  uint64 top;
+
+  if(len == 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || f->readable == 0)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && f->writable == 0)
+    return -1;
+
+  len = PGROUNDUP(len);
+  acquire(&p->tlock);
+  top = mmapbase(p);
+  if(len > top - PGROUNDUP(p->sz) || (v = vmaalloc(p)) == 0){
+    release(&p->tlock);
+    return -1;
+  }
+  v->addr = top - len;
+  v->prot = prot;
+  v->flags = flags;
+  v->off = off;
+  v->filesz = len;
+  v->ip = idup(f->ip);
+  // other threads' faults look v up without the lock.
+  __sync_synchronize();
+  v->len = len;
+  release(&p->tlock);
+  return top - len;
+}
+
+// Read the page of region v that contains va in from the file
+// and map it. Fails if the access isn't allowed by v->prot.
+// Returns the physical address, or 0.
+uint64
+mmapfault(struct proc *p, struct vma *v, uint64 va, int read)
+{
+  struct inode *ip = v->ip;
+  uint64 mem, n;
+  int perm;
+
+  if(read && (v->prot & PROT_READ) == 0)
+    return 0;
+  if(!read && (v->prot & PROT_WRITE) == 0)
+    return 0;
+  // readi() may sleep.
+  if(!intr_get())
+    return 0;
+  va = PGROUNDDOWN(va);
+  if(ismapped(p->pagetable, va))
+    return 0;
+
+  n = 0;
+  if(va - v->addr < v->filesz)
+    n = min(PGSIZE, v->filesz - (va - v->addr));
+  if(v->flags & MAP_SHARED){
+    // the one copy that all shared mappings, read() and write() use.
+    if((mem = pcacheget(ip, v->off + (va - v->addr), PGSIZE, 1)) == 0)
+      return 0;
+  } else if((v->prot & PROT_WRITE) == 0 && n > 0){
+    // can't be written, so share it with other processes.
+    if((mem = pcacheget(ip, v->off + (va - v->addr), n, 0)) == 0)
+      return 0;
+  } else {
+    if((mem = (uint64)kalloc()) == 0)
+      return 0;
+    memset((void*)mem, 0, PGSIZE);
+    if(n > 0){
+      ilock(ip);
+      // a short read at the end of the file leaves the rest zero.
+      readi(ip, 0, mem, v->off + (va - v->addr), n);
+      iunlock(ip);
+    }
+  }
+
+  perm = PTE_U;
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return uvmfaultmap(p, va, mem, perm);
+}
+
+// Fault in the mapped pages of [va, va+n) that aren't present,
+// so that copying to or from them later needn't sleep.
+void
+mmapprefault(struct proc *p, uint64 va, uint64 n, int write)
+{
+  struct vma *v;
+  uint64 a, start, end;
+
+  if(va + n < va)
+    return;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    start = PGROUNDDOWN(va);
+    if(start < v->addr)
+      start = v->addr;
+    end = min(va + n, v->addr + v->len);
+    for(a = start; a < end; a += PGSIZE)
+      if(!ismapped(p->pagetable, a))
+        mmapfault(p, v, a, !write);
+  }
+}
+
+// Write the page at pa, mapped at va in shared region v, back
+// to the file, leaving out any part beyond the end of the file.
+static void
+mmapwriteback(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->ip;
+  uint off = v->off + (va - v->addr);
+
+  begin_op();
+  ilock(ip);
+  // within the file, so no blocks need allocating and the
+  // page fits in one transaction.
+  if(off < ip->size)
+    writei(ip, 0, pa, off, min(PGSIZE, ip->size - off));
+  iunlock(ip);
+  end_op();
+}
+
+// Unmap [addr, addr+len) from p, which must lie within a single
+// mmap()ed region, writing back dirty shared pages. Unmapping the
+// middle of a region splits it in two.
+// Returns 0, or -1.
+int
+munmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, *nv;
+  uint64 a, end;
+  pte_t *pte;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  if((v = vmalookup(p, addr)) == 0 || end < addr || end > v->addr + v->len)
+    return -1;
+  if(v->flags & VMA_SEGMENT)
+    return -1;
+  nv = 0;
+  if(addr > v->addr && end < v->addr + v->len && (nv = vmaalloc(p)) == 0)
+    return -1;
+
+  for(a = addr; a < end; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if((v->flags & MAP_SHARED) && (*pte & PTE_D))
+      mmapwriteback(v, a, PTE2PA(*pte));
+    uvmunmap(p->pagetable, a, 1, 1);
+  }
+
+  if(nv){
+    // keep the part below addr in v, the part above in nv.
+    *nv = *v;
+    nv->addr = end;
+    nv->len = v->addr + v->len - end;
+    nv->off = v->off + (end - v->addr);
+    nv->filesz = nv->len;
+    idup(nv->ip);
+    v->len = addr - v->addr;
+  } else if(addr == v->addr){
+    v->off += end - addr;
+    v->len -= end - addr;
+    v->addr = end;
+  } else {
+    v->len = addr - v->addr;
+  }
+  v->filesz = v->len;
+  if(v->len == 0)
+    vmadrop(v);
+  return 0;
+}
+
+// Unmap all of p's regions, as exit and exec do. The pages of
+// program segments are left for uvmfree().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    if(v->flags & VMA_SEGMENT)
+      vmadrop(v);
+    else
+      munmap(p, v->addr, v->len);
+  }
+}
+
+// The process has shrunk to sz: forget the parts of program
+// segments above it, so that growing again gives zeroed memory.
+void
+mmapshrink(struct proc *p, uint64 sz)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || (v->flags & VMA_SEGMENT) == 0 ||
+       v->addr + v->len <= PGROUNDUP(sz))
+      continue;
+    if(v->addr >= PGROUNDUP(sz)){
+      vmadrop(v);
+    } else {
+      v->len = PGROUNDUP(sz) - v->addr;
+      v->filesz = min(v->filesz, sz - v->addr);
+    }
+  }
+}
+
+// Give child np copies of p's regions, and the pages in the
+// mmap()ed ones that are present; uvmcopy() has done the pages of
+// program segments. Pages of shared regions, and pages that can't
+// be written, are shared with the child; the rest are copied. The
+// child's mappings aren't marked dirty, so a shared page is only
+// written back by a process that writes it.
+// Doesn't sleep. Returns 0, or -1 with nothing copied.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  uint64 a, pa, flags;
+  pte_t *pte;
+  char *mem;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->flags & VMA_SEGMENT)
+      continue;
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte) & ~PTE_D;
+      if((v->flags & MAP_SHARED) || (flags & PTE_W) == 0){
+        kdup((void*)pa);
+        mem = (char*)pa;
+      } else {
+        if((mem = kalloc()) == 0)
+          goto err;
+        memmove(mem, (char*)pa, PGSIZE);
+      }
+      if(mappages(np->pagetable, a, PGSIZE, (uint64)mem, flags) != 0){
+        kfree(mem);
+        goto err;
+      }
+    }
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    np->vma[v - p->vma] = *v;
+    if(v->len > 0)
+      idup(v->ip);
+    if(v->len > 0 && (v->flags & VMA_SEGMENT))
+      __sync_fetch_and_add(&v->ip->nexec, 1);
+  }
+  return 0;
+
+ err:
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && (v->flags & VMA_SEGMENT) == 0)
+      uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+  return -1;
+}
@@ -1,8 +1,7 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // in-memory i-nodes before unused ones are recycled
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -10,6 +9,17 @@
 #define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define PREALLOC     8     // blocks reserved ahead of a growing file
 #define MAXPATH      128   // maximum file path name
+#define PIPESIZE     4096  // pipe buffer bytes; a power of 2, at most PGSIZE
 #define USERSTACK    1     // user stack pages
+#define NUTLB        8     // cached user translations per process
+#define NVMA         16    // mmap()ed regions per process
+#define NPCACHE      64    // read-only file pages shared between processes
+#define NMEGA        4     // 2-megabyte pages set aside first for SBRK_HUGE heaps
+#define NDCACHE      128   // cached directory lookups
+#define NIOV         16    // max buffers per readv() or writev()
+#define NAIO         16    // outstanding asynchronous I/O requests per process
+#define NAIOTHREAD   2     // kernel threads carrying out asynchronous I/O
+#define NTHREAD      16    // clone()d threads per process, at most 32
 
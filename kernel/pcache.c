@@ -0,0 +1,221 @@
+//
+// Cache of file pages, so that processes running the same
+// program, or mapping the same file, share one physical copy of
+// each page instead of reading in their own.
+//
+// An entry names the page holding n bytes of inode (dev, inum)
+// from offset off, zero-filled after them, and holds one of the
+// page's references (see kalloc.c); each process that maps the
+// page holds another. mmapfault() looks pages up here for
+// regions that can't be written, and for all MAP_SHARED ones.
+//
+// A read-only page must not outlive the contents it copies.
+// writei() drops the ones a write overlaps, itrunc() drops all of
+// an inode's pages, and iget() drops them when it recycles the
+// inode's table entry, so that a reused inode number can't find
+// them. Pages already mapped keep their contents, just as a
+// private copy would.
+//
+// A shared page, one for a MAP_SHARED region, is instead the one
+// copy of its part of the file that every process mapping it uses,
+// and may be newer than the disk: stores through a mapping go
+// straight to it, and are written back when a process that made
+// them unmaps the page (see mmap.c). So that read() and write()
+// agree with the mappings, writei() copies what it writes into the
+// shared pages it overlaps, and readi() reads from them rather
+// than from the disk. A shared page is only replaced once no
+// process maps it, by which time what was written through it has
+// been written back.
+//
+// ip->pcached records that an inode may have pages here, so that
+// other inodes don't pay for the search.
+//
+// The table is small; when it is full, a new page replaces an
+// old one; a read-only one lives on for as long as it is mapped.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "defs.h"
+
+struct pcent {
+  uint dev;
+  uint inum;
+  uint off;
+  uint n;
+  int shared;     // for MAP_SHARED regions
+  uint64 pa;      // 0 if the entry is free
+};
+
+struct {
+  struct spinlock lock;
+  struct pcent ent[NPCACHE];
+  int hand;       // next entry to replace
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Look up a page and take a reference to it.
+// Caller must hold pcache.lock.
+static uint64
+pclookup(struct inode *ip, uint off, uint n, int shared)
+{
+  struct pcent *e;
+
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->pa && e->dev == ip->dev && e->inum == ip->inum &&
+       e->off == off && e->n == n && e->shared == shared){
+      kdup((void*)e->pa);
+      return e->pa;
+    }
+  }
+  return 0;
+}
+
+// Find an entry for a new page: a free one, or the next one
+// whose page can be replaced.
+// Caller must hold pcache.lock. Returns 0 if there is none.
+static struct pcent*
+pcvictim(void)
+{
+  struct pcent *e;
+  int i;
+
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++)
+    if(e->pa == 0)
+      return e;
+  for(i = 0; i < NPCACHE; i++){
+    e = &pcache.ent[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCACHE;
+    // a shared page must stay the only copy while it is mapped.
+    if(e->shared && krefs((void*)e->pa) > 1)
+      continue;
+    kfree((void*)e->pa);
+    e->pa = 0;
+    return e;
+  }
+  return 0;
+}
+
+// Return a page holding n bytes of ip from offset off, at most
+// PGSIZE, followed by zeroes, with a reference for the caller to
+// map and kfree(). If shared is 0 the page must not be written;
+// otherwise it is the page that all MAP_SHARED mappings of that
+// part of the file use, off must be page-aligned and n PGSIZE.
+// Returns the physical address, or 0.
+uint64
+pcacheget(struct inode *ip, uint off, uint n, int shared)
+{
+  struct pcent *e;
+  uint64 mem, pa;
+
+  acquire(&pcache.lock);
+  mem = pclookup(ip, off, n, shared);
+  release(&pcache.lock);
+  if(mem)
+    return mem;
+
+  if((mem = (uint64)kalloc()) == 0)
+    return 0;
+  memset((void*)mem, 0, PGSIZE);
+
+  // hold the inode lock until the page is in the table, so
+  // that a writei() can't slip in between and leave it stale.
+  ilock(ip);
+  // a short read at the end of the file leaves the rest zero.
+  readi(ip, 0, mem, off, n);
+  acquire(&pcache.lock);
+  if((pa = pclookup(ip, off, n, shared)) != 0){
+    // read in by another process meanwhile.
+    release(&pcache.lock);
+    iunlock(ip);
+    kfree((void*)mem);
+    return pa;
+  }
+  if((e = pcvictim()) == 0){
+    // every entry is a shared page in use.
+    release(&pcache.lock);
+    iunlock(ip);
+    kfree((void*)mem);
+    return 0;
+  }
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->n = n;
+  e->shared = shared;
+  e->pa = mem;
+  kdup((void*)mem);
+  ip->pcached = 1;
+  release(&pcache.lock);
+  iunlock(ip);
+  return mem;
+}
+
+// Return ip's shared page that holds offset off, with a
+// reference for the caller to kfree(), or 0 if there is none.
+// Caller must hold ip's lock.
+uint64
+pcacheshared(struct inode *ip, uint off)
+{
+  uint64 pa;
+
+  acquire(&pcache.lock);
+  pa = pclookup(ip, PGROUNDDOWN(off), PGSIZE, 1);
+  release(&pcache.lock);
+  return pa;
+}
+
+// writei() has written the n bytes at src to ip at offset off,
+// all within one page: copy them into the shared page there, if
+// there is one, and drop any read-only copy.
+// Caller must hold ip's lock.
+void
+pcachewrite(struct inode *ip, uint off, char *src, uint n)
+{
+  struct pcent *e;
+
+  acquire(&pcache.lock);
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->pa == 0 || e->dev != ip->dev || e->inum != ip->inum)
+      continue;
+    if(e->shared){
+      if(e->off == PGROUNDDOWN(off))
+        memmove((char*)e->pa + off % PGSIZE, src, n);
+    } else if(off < e->off + e->n && e->off < off + n){
+      kfree((void*)e->pa);
+      e->pa = 0;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Drop the cached pages of ip, which is about to be truncated
+// or leave the inode table. Caller must hold ip's lock, or the
+// last reference to it, or be recycling or freeing its table
+// entry.
+void
+pcacheinval(struct inode *ip)
+{
+  struct pcent *e;
+
+  acquire(&pcache.lock);
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->pa && e->dev == ip->dev && e->inum == ip->inum){
+      kfree((void*)e->pa);
+      e->pa = 0;
+    }
+  }
+  ip->pcached = 0;
+  release(&pcache.lock);
+}
@@ -8,15 +8,20 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
+// The ring buffer holds PIPESIZE bytes (see param.h). nread and
+// nwrite run freely and wrap; PIPESIZE must be a power of two so
+// that % PIPESIZE stays continuous when they do.
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int wsplice;    // splice() is filling the ring after nwrite
+  int rsplice;    // splice() is draining the ring from nread
 };
 
 int
@@ -28,12 +33,16 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmalloc(sizeof(struct pipe))) == 0)
+    goto bad;
+  if((pi->data = kmalloc(PIPESIZE)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->wsplice = 0;
+  pi->rsplice = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -46,8 +55,11 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
-  if(pi)
-    kfree((char*)pi);
+  if(pi){
+    if(pi->data)
+      kmfree(pi->data);
+    kmfree((char*)pi);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,15 +80,31 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmfree(pi->data);
+    kmfree((char*)pi);
   } else
     release(&pi->lock);
 }
 
+// Bytes that can be moved between the ring at index i and user
+// address addr with one copy: no more than m, no further than
+// the end of the ring, and within one user page, so that a bad
+// page only fails the copy it starts.
+static uint
+pipechunk(uint i, uint64 addr, uint m)
+{
+  if(m > PIPESIZE - i % PIPESIZE)
+    m = PIPESIZE - i % PIPESIZE;
+  if(m > PGSIZE - addr % PGSIZE)
+    m = PGSIZE - addr % PGSIZE;
+  return m;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
+  uint m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,15 +113,17 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+    if(pi->nwrite == pi->nread + PIPESIZE || pi->wsplice){ //DOC: pipewrite-full
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      m = pipechunk(pi->nwrite, addr + i,
+                    min(n - i, PIPESIZE - (pi->nwrite - pi->nread)));
+      if(copyin(pr->pagetable, pi->data + pi->nwrite % PIPESIZE,
+                addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -106,29 +136,148 @@ int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rsplice){  //DOC: pipe-empty
     if(killed(pr)){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1) {
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    m = pipechunk(pi->nread, addr + i, min(n - i, pi->nwrite - pi->nread));
+    if(copyout(pr->pagetable, addr + i,
+               pi->data + pi->nread % PIPESIZE, m) == -1) {
       if(i == 0)
         i = -1;
       break;
     }
-    pi->nread++;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// splice() moves data between a pipe and a file through the
+// buffer cache, with readi()/writei() copying straight to or
+// from the ring, so the data never passes through user space.
+// Those may sleep, so the pipe lock can't be held while they
+// run. Instead splice() reserves the part of the ring it is
+// working on: wsplice marks the free space after nwrite as being
+// filled, rsplice the data from nread as being drained. Readers
+// never look past nwrite and writers never past nread, so each
+// only has to wait for a reservation on its own side.
+
+// Move up to n bytes from file f into the pipe, starting at f's
+// offset. Like pipewrite(), waits for room until all n bytes
+// are moved; stops early at the end of the file.
+// Returns the number of bytes moved, or -1.
+int
+pipesplicein(struct pipe *pi, struct file *f, int n)
+{
+  int i = 0, r;
+  uint m;
+  char *dst;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(i < n){
+    if(pi->readopen == 0 || killed(pr)){
+      release(&pi->lock);
+      return -1;
+    }
+    if(pi->nwrite == pi->nread + PIPESIZE || pi->wsplice){
+      wakeup(&pi->nread);
+      sleep(&pi->nwrite, &pi->lock);
+      continue;
+    }
+    m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+    m = min(m, PIPESIZE - pi->nwrite % PIPESIZE);
+    dst = pi->data + pi->nwrite % PIPESIZE;
+    pi->wsplice = 1;
+    release(&pi->lock);
+
+    ilock(f->ip);
+    if((r = readi(f->ip, 0, (uint64)dst, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+
+    acquire(&pi->lock);
+    pi->wsplice = 0;
+    wakeup(&pi->nwrite);  // writers waiting for wsplice
+    if(r > 0){
+      pi->nwrite += r;
+      i += r;
+    }
+    if(r != m){
+      // end of file, or an error from readi
+      if(r < 0 && i == 0)
+        i = -1;
+      break;
+    }
+  }
+  wakeup(&pi->nread);
+  release(&pi->lock);
+
+  return i;
+}
+
+// Move up to n bytes from the pipe into file f, at f's offset.
+// Like piperead(), waits until the pipe has some data, then
+// moves what there is.
+// Returns the number of bytes moved, or -1.
+int
+pipespliceout(struct pipe *pi, struct file *f, int n)
+{
+  int i, r;
+  uint m;
+  char *src;
+  struct proc *pr = myproc();
+  // as in filewrite(): keep each transaction within the log.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+
+  acquire(&pi->lock);
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rsplice){
+    if(killed(pr)){
+      release(&pi->lock);
+      return -1;
+    }
+    sleep(&pi->nread, &pi->lock);
+  }
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += r){
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - pi->nread % PIPESIZE);
+    m = min(m, max);
+    src = pi->data + pi->nread % PIPESIZE;
+    pi->rsplice = 1;
+    release(&pi->lock);
+
+    begin_op();
+    ilock(f->ip);
+    if((r = writei(f->ip, 0, (uint64)src, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    end_op();
+
+    acquire(&pi->lock);
+    pi->rsplice = 0;
+    if(r > 0)
+      pi->nread += r;
+    if(r != m){
+      // error from writei
+      if(r > 0)
+        i += r;
+      if(i == 0)
+        i = -1;
+      break;
+    }
+  }
+  wakeup(&pi->nread);   // readers waiting for rsplice
+  wakeup(&pi->nwrite);
+  release(&pi->lock);
+  return i;
+}
@@ -8,11 +8,45 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// struct procs are allocated on demand, a page's worth at a time.
+// allproc threads every struct proc of the pool's pages (newest
+// first); procpool.freelist holds the UNUSED ones. Both lists are
+// changed only under procpool.lock, but allproc is walked without
+// it, by code bracketed with procscan() and procscandone().
+//
+// Once all of a page's procs are UNUSED the page is unlinked from
+// both lists and retired; a walk under way may still be looking at
+// it, so it goes back to kalloc() only once no walk is, and no one
+// holds the lock of one of its procs (e.g. the caller of the
+// freeproc() that retired it).
+//
+// Kernel stacks are allocated and mapped at boot, NPROC of them,
+// each with an invalid guard page below it, so that the kernel page
+// table never changes afterwards; their number limits the number of
+// processes.
+struct proc *allproc;
+
+struct procpage {
+  struct procpage *next;       // on procpool.retired
+  int nfree;                   // procs of this page on the free list
+  struct proc proc[];
+};
+
+#define PROCSPERPAGE ((PGSIZE - sizeof(struct procpage)) / sizeof(struct proc))
+
+struct {
+  struct spinlock lock;
+  struct proc *freelist;
+  struct procpage *retired;    // unlinked, waiting to be freed
+  uint64 kstack[NPROC];        // free kernel stacks
+  int nkstack;
+  int nscan;                   // walks of allproc under way
+} procpool;
 
 struct proc *initproc;
 
 int nextpid = 1;
+int nextkpid = -1;    // kernel threads' pids count down, apart from users'
 struct spinlock pid_lock;
 
 // MLFQ Queue structures
@@ -33,6 +67,7 @@ uint64 scheduler_cycle_count = 0;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void threadexit(struct proc *p, int status);
 
 extern char trampoline[]; // trampoline.S
 
@@ -164,7 +199,8 @@ priority_boost(void)
   }
   
   // Move all runnable processes back to level 0
-  for(p = proc; p < &proc[NPROC]; p++) {
+  procscan();
+  for(p = allproc; p != 0; p = p->allnext) {
     acquire(&p->lock);
     if(p->state == RUNNABLE) {
       p->queue_level = 0;
@@ -173,47 +209,140 @@ priority_boost(void)
     }
     release(&p->lock);
   }
+  procscandone();
   
   ticks_since_boost = 0;
 }
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// initialize the proc table.
+void
+procinit(void)
+{
+  initlock(&pid_lock, "nextpid");
+  initlock(&wait_lock, "wait_lock");
+  initlock(&mlfq_lock, "mlfq");           // Initialize MLFQ lock
+  initlock(&stats_lock, "stats");         // Week 3: Initialize stats lock
+  initlock(&procpool.lock, "procpool");
+}
+
+// Allocate a page for each process's kernel stack and map it
+// high in memory, followed by an invalid guard page.
 void
 proc_mapstacks(pagetable_t kpgtbl)
 {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
+  int i;
+
+  for(i = 0; i < NPROC; i++) {
     char *pa = kalloc();
     if(pa == 0)
       panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
+    uint64 va = KSTACK(i);
     kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+    procpool.kstack[i] = va;
   }
+  procpool.nkstack = NPROC;
 }
 
-// initialize the proc table.
+// Begin and end a walk of allproc, which takes no lock; while
+// one is under way no retired page is freed.
 void
-procinit(void)
+procscan(void)
 {
-  struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
-  initlock(&wait_lock, "wait_lock");
-  initlock(&mlfq_lock, "mlfq");           // Initialize MLFQ lock
-  initlock(&stats_lock, "stats");         // Week 3: Initialize stats lock
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-      // Initialize MLFQ fields
-      p->queue_level = 0;       // Start at highest priority
-      p->time_in_queue = 0;
-      p->time_slices = 0;
-      p->entered_queue_tick = 0;
+  __sync_fetch_and_add(&procpool.nscan, 1);
+}
+
+void
+procscandone(void)
+{
+  __sync_fetch_and_sub(&procpool.nscan, 1);
+}
+
+static struct procpage*
+procpageof(struct proc *p)
+{
+  return (struct procpage*)PGROUNDDOWN((uint64)p);
+}
+
+// Carve a fresh page into UNUSED struct procs, add them
+// to allproc and to the free list.
+// Caller must hold procpool.lock.
+// Returns 0 if out of memory.
+static int
+procgrow(void)
+{
+  struct procpage *pg;
+  struct proc *p, *new;
+  int i, n = PROCSPERPAGE;
+
+  if((pg = (struct procpage*)kalloc()) == 0)
+    return 0;
+  memset(pg, 0, PGSIZE);
+  pg->nfree = n;
+  new = pg->proc;
+  for(i = 0; i < n; i++){
+    p = &new[i];
+    initlock(&p->lock, "proc");
+    initlock(&p->tlock, "tlock");
+    p->state = UNUSED;
+    p->allnext = (i == n-1) ? allproc : &new[i+1];
+    p->freenext = (i == n-1) ? procpool.freelist : &new[i+1];
+  }
+
+  // scanners walk allproc without procpool.lock, so the new
+  // entries must be visible before the list head is.
+  __sync_synchronize();
+  allproc = new;
+  procpool.freelist = new;
+  return 1;
+}
+
+// Take page pg, all of whose procs are UNUSED, out of allproc
+// and the free list, and queue it to be freed. Its procs are
+// adjacent in allproc; a walk that is at one of them goes on
+// from there to the rest of the list.
+// Caller must hold procpool.lock.
+static void
+procretire(struct procpage *pg)
+{
+  struct proc *first = &pg->proc[0];
+  struct proc *last = &pg->proc[PROCSPERPAGE-1];
+  struct proc **pp;
+
+  for(pp = &allproc; *pp != first; pp = &(*pp)->allnext)
+    ;
+  *pp = last->allnext;
+  for(pp = &procpool.freelist; *pp != 0; ){
+    if(procpageof(*pp) == pg)
+      *pp = (*pp)->freenext;
+    else
+      pp = &(*pp)->freenext;
+  }
+  pg->next = procpool.retired;
+  procpool.retired = pg;
+}
+
+// Free the retired pages that nothing can still be using.
+// Caller must hold procpool.lock.
+static void
+procreap(void)
+{
+  struct procpage *pg, **pgp;
+  int i;
+
+  // a walk that begins after this sees allproc without them.
+  __sync_synchronize();
+  if(procpool.nscan != 0)
+    return;
+  for(pgp = &procpool.retired; (pg = *pgp) != 0; ){
+    for(i = 0; i < PROCSPERPAGE; i++)
+      if(pg->proc[i].lock.locked)
+        break;
+    if(i < PROCSPERPAGE){
+      pgp = &pg->next;
+      continue;
+    }
+    *pgp = pg->next;
+    kfree(pg);
   }
 }
 
@@ -261,28 +390,63 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Take an UNUSED proc from the pool, growing the pool if
+// it is empty, and give it a kernel stack. Initialize state
+// required to run in the kernel, and return with p->lock held.
+// If there are already NPROC processes, or a memory allocation
+// fails, return 0.
 static struct proc*
-allocproc(void)
+procnew(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  acquire(&procpool.lock);
+  procreap();
+  if(procpool.nkstack == 0 ||
+     (procpool.freelist == 0 && procgrow() == 0)){
+    release(&procpool.lock);
+    return 0;
   }
-  return 0;
+  p = procpool.freelist;
+  procpool.freelist = p->freenext;
+  p->freenext = 0;
+  procpageof(p)->nfree--;
+  p->kstack = procpool.kstack[--procpool.nkstack];
+  release(&procpool.lock);
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("procnew");
   p->state = USED;
+  p->leader = p;
+
+  // Set up new context to start executing at forkret,
+  // which returns to user space.
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.ra = (uint64)forkret;
+  p->context.sp = p->kstack + PGSIZE;
+
+  // Initialize MLFQ fields for new process
+  p->queue_level = 0;          // Start at highest priority queue
+  p->time_in_queue = 0;        // Reset time in current queue
+  p->time_slices = 0;          // Reset total time slices
+  p->entered_queue_tick = 0;   // Will be set when first scheduled
+  p->queue_next = 0;           // Not in any queue yet
+
+  return p;
+}
+
+// A new user process: procnew(), plus a pid, a trapframe and
+// an empty user page table. Returns with p->lock held, or 0.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = procnew()) == 0)
+    return 0;
+  p->pid = allocpid();
+  p->tfva = TRAPFRAME;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -299,34 +463,34 @@ found:
     return 0;
   }
 
-  // Set up new context to start executing at forkret,
-  // which returns to user space.
-  memset(&p->context, 0, sizeof(p->context));
-  p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
-
-  // Initialize MLFQ fields for new process
-  p->queue_level = 0;          // Start at highest priority queue
-  p->time_in_queue = 0;        // Reset time in current queue
-  p->time_slices = 0;          // Reset total time slices
-  p->entered_queue_tick = 0;   // Will be set when first scheduled
-  p->queue_next = 0;           // Not in any queue yet
-
   return p;
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, and return it and its kernel stack
+// to the pool.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
+  struct procpage *pg;
+
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
+  if(p->pagetable && p->leader != p)
+    uvmunmap(p->pagetable, p->tfva, 1, 0);  // the rest is the leader's
+  else if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->ring = 0;      // freed with the page table
+  p->ringbusy = 0;
+  p->leader = 0;
+  p->tslots = 0;
+  p->tdying = 0;
+  p->cloned = 0;
+  p->utlbgen = 0;   // empty the translation cache
+  memset(p->asid, 0, sizeof(p->asid));
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -341,6 +505,17 @@ freeproc(struct proc *p)
   p->time_slices = 0;
   p->entered_queue_tick = 0;
   p->queue_next = 0;
+
+  acquire(&procpool.lock);
+  procpool.kstack[procpool.nkstack++] = p->kstack;
+  p->kstack = 0;
+  p->freenext = procpool.freelist;
+  procpool.freelist = p;
+  pg = procpageof(p);
+  if(++pg->nfree == PROCSPERPAGE)
+    procretire(pg);
+  procreap();
+  release(&procpool.lock);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -384,6 +559,8 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  if(ismapped(pagetable, RING))
+    uvmunmap(pagetable, RING, 1, 1);
   uvmfree(pagetable, sz);
 }
 
@@ -403,37 +580,93 @@ userinit(void)
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
-growproc(int n)
+static void
+kprocstart(void)
 {
-  uint64 sz;
   struct proc *p = myproc();
 
-  sz = p->sz;
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kproc returned");
+}
+
+// Start a kernel thread running fn(), which must not return.
+// It is a process that never leaves the kernel, so it has no
+// trapframe or user page table, scheduled like any other. Its
+// pid is negative, so user pids are the same with or without
+// kernel threads, and kill() can't reach it.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = procnew()) == 0)
+    panic("kproc");
+  acquire(&pid_lock);
+  p->pid = nextkpid--;
+  release(&pid_lock);
+  p->kfn = fn;
+  p->context.ra = (uint64)kprocstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  enqueue(p);
+  release(&p->lock);
+}
+
+// Grow or shrink user memory by n bytes; if huge, grow
+// using megapages where possible. A process with more than
+// one thread can only grow (see threaded()).
+// Return the old size, or -1 on failure.
+uint64
+growproc(int n, int huge)
+{
+  uint64 sz, oldsz;
+  struct proc *p = myproc()->leader;
+
+  if(n < 0){
+    if(threaded(p))
+      return -1;
+    sz = oldsz = p->sz;
+    if(sz + n < sz && uvmsplit(p->pagetable, PGROUNDUP(sz + n)) < 0)
+      return -1;
+    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    mmapshrink(p, sz);
+    p->sz = sz;
+    return oldsz;
+  }
+
+  acquire(&p->tlock);
+  sz = oldsz = p->sz;
   if(n > 0){
-    if(sz + n > TRAPFRAME) {
+    if(sz + n < sz || sz + n > mmapbase(p)) {
+      release(&p->tlock);
       return -1;
     }
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(huge)
+      sz = uvmallocmega(p->pagetable, sz, sz + n, PTE_W);
+    else
+      sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W);
+    if(sz == 0) {
+      release(&p->tlock);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
-  return 0;
+  release(&p->tlock);
+  return oldsz;
 }
 
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
+// A thread's child copies the process, and is the leader's child.
 int
 kfork(void)
 {
   int i, pid;
   struct proc *np;
-  struct proc *p = myproc();
+  struct proc *t = myproc();
+  struct proc *p = t->leader;
 
   // Allocate process.
   if((np = allocproc()) == 0){
@@ -448,8 +681,15 @@ kfork(void)
   }
   np->sz = p->sz;
 
+  // Copy mmap()ed regions and the ring page.
+  if(mmapcopy(p, np) < 0 || ringcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
-  *(np->trapframe) = *(p->trapframe);
+  *(np->trapframe) = *(t->trapframe);
 
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
@@ -485,12 +725,14 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  procscan();
+  for(pp = allproc; pp != 0; pp = pp->allnext){
     if(pp->parent == p){
       pp->parent = initproc;
       wakeup(initproc);
     }
   }
+  procscandone();
 }
 
 // Exit the current process.  Does not return.
@@ -504,6 +746,18 @@ kexit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  if(p->leader != p)
+    threadexit(p, status);
+
+  // The other threads use the memory and files released below.
+  threadkill(p);
+
+  // Write back and unmap mmap()ed regions.
+  munmapall(p);
+
+  // Finish asynchronous I/O; it holds references to files.
+  aiodrain(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -540,19 +794,22 @@ kexit(int status)
 
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
+// A thread waits for its process's children.
 int
 kwait(uint64 addr)
 {
   struct proc *pp;
   int havekids, pid;
-  struct proc *p = myproc();
+  struct proc *t = myproc();
+  struct proc *p = t->leader;
 
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
+    procscan();
+    for(pp = allproc; pp != 0; pp = pp->allnext){
       if(pp->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
@@ -564,20 +821,23 @@ kwait(uint64 addr)
           if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
                                   sizeof(pp->xstate)) < 0) {
             release(&pp->lock);
+            procscandone();
             release(&wait_lock);
             return -1;
           }
           freeproc(pp);
           release(&pp->lock);
+          procscandone();
           release(&wait_lock);
           return pid;
         }
         release(&pp->lock);
       }
     }
+    procscandone();
 
     // No point waiting if we don't have any children.
-    if(!havekids || killed(p)){
+    if(!havekids || killed(t)){
       release(&wait_lock);
       return -1;
     }
@@ -587,6 +847,229 @@ kwait(uint64 addr)
   }
 }
 
+// Threads. clone() makes a struct proc that shares its leader's
+// page table, and uses the leader's sz, vma[], ring, ofile[] and
+// cwd; its own are unused. It has its own kernel stack and
+// trapframe, the trapframe mapped at a THREADTF() slot of the
+// shared page table instead of at TRAPFRAME; prepare_return()
+// tells trampoline.S which. The slots are reserved below RING by
+// the first clone() and stay so until exec().
+//
+// A thread's exit() leaves it a zombie for join(). The leader's
+// exit() or exec() first kills its threads and frees them. A thread
+// can't exec().
+//
+// Page table changes by one thread reach the others without any
+// TLB flush as long as they only add mappings (see uvmspurious()),
+// but removing one would need the harts running the others to
+// flush, and nothing can make them. So a process with threads
+// can't shrink: sbrk(-n), munmap() and madvise() fail.
+
+// Does p's process have more than one thread?
+int
+threaded(struct proc *p)
+{
+  return p->leader->tslots != 0;
+}
+
+// Start a thread of the current process running fn(arg) in user
+// space, on the stack whose top is at stack.
+// Returns the thread's pid, or -1.
+int
+kclone(uint64 fn, uint64 arg, uint64 stack)
+{
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+  int slot, pid;
+
+  // reserve the trapframe slots, unless the heap or a
+  // mapped region is already there.
+  acquire(&l->tlock);
+  if(!l->cloned){
+    if(PGROUNDUP(l->sz) > THREADTF(NTHREAD-1) || mmapbase(l) < RING){
+      release(&l->tlock);
+      return -1;
+    }
+    l->cloned = 1;
+  }
+  release(&l->tlock);
+
+  acquire(&wait_lock);
+  for(slot = 0; slot < NTHREAD; slot++)
+    if((l->tslots & (1 << slot)) == 0)
+      break;
+  if(slot == NTHREAD || l->tdying){
+    release(&wait_lock);
+    return -1;
+  }
+  l->tslots |= 1 << slot;
+  release(&wait_lock);
+
+  if((np = allocproc()) == 0)
+    goto bad;
+  acquire(&l->tlock);
+  if(mappages(l->pagetable, THREADTF(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&l->tlock);
+    freeproc(np);
+    release(&np->lock);
+    goto bad;
+  }
+  release(&l->tlock);
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = l->pagetable;
+  np->tfva = THREADTF(slot);
+  np->tslot = slot;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack & ~0xFUL;  // riscv sp must be 16-byte aligned
+  np->trapframe->ra = 0;
+  safestrcpy(np->name, l->name, sizeof(l->name));
+  pid = np->pid;
+  release(&np->lock);
+
+  // a thread's pagetable is its leader's from here on.
+  acquire(&wait_lock);
+  acquire(&np->lock);
+  np->leader = l;
+  np->state = RUNNABLE;
+  enqueue(np);
+  release(&np->lock);
+  release(&wait_lock);
+  return pid;
+
+ bad:
+  acquire(&wait_lock);
+  l->tslots &= ~(1 << slot);
+  release(&wait_lock);
+  return -1;
+}
+
+// Free zombie thread pp. Caller must hold wait_lock and pp->lock.
+static void
+threadfree(struct proc *pp)
+{
+  pp->leader->tslots &= ~(1 << pp->tslot);
+  freeproc(pp);
+}
+
+// Wait for thread tid of the current process, or for any of its
+// threads if tid is 0, to exit, and free it. Copies its exit
+// status to addr, if not 0.
+// Returns its pid, or -1 if there is no such thread.
+int
+kjoin(int tid, uint64 addr)
+{
+  struct proc *pp;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+  int havethreads, pid;
+
+  acquire(&wait_lock);
+  for(;;){
+    havethreads = 0;
+    procscan();
+    for(pp = allproc; pp != 0; pp = pp->allnext){
+      if(pp == p || pp == l || pp->leader != l)
+        continue;
+      if(tid != 0 && pp->pid != tid)
+        continue;
+      acquire(&pp->lock);
+      havethreads = 1;
+      if(pp->state == ZOMBIE){
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
+          release(&pp->lock);
+          procscandone();
+          release(&wait_lock);
+          return -1;
+        }
+        threadfree(pp);
+        release(&pp->lock);
+        procscandone();
+        release(&wait_lock);
+        return pid;
+      }
+      release(&pp->lock);
+    }
+    procscandone();
+
+    if(!havethreads || killed(p)){
+      release(&wait_lock);
+      return -1;
+    }
+
+    // exiting threads wake their leader.
+    sleep(l, &wait_lock);
+  }
+}
+
+// Kill leader p's threads and free them once they have exited,
+// for exit() and exec(). Called by p.
+void
+threadkill(struct proc *p)
+{
+  struct proc *pp;
+  int left;
+
+  acquire(&wait_lock);
+  p->tdying = 1;
+  for(;;){
+    left = 0;
+    procscan();
+    for(pp = allproc; pp != 0; pp = pp->allnext){
+      if(pp == p || pp->leader != p)
+        continue;
+      acquire(&pp->lock);
+      if(pp->state == ZOMBIE){
+        threadfree(pp);
+      } else {
+        left = 1;
+        pp->killed = 1;
+        if(pp->state == SLEEPING){
+          pp->state = RUNNABLE;
+          enqueue(pp);
+        }
+      }
+      release(&pp->lock);
+    }
+    procscandone();
+    if(!left)
+      break;
+    sleep(p, &wait_lock);
+  }
+  p->tdying = 0;
+  release(&wait_lock);
+}
+
+// Exit thread p, which isn't its process's leader. Its memory
+// and files are the leader's, so there is little to release.
+// Does not return.
+static void
+threadexit(struct proc *p, int status)
+{
+  aiodrain(p);
+
+  acquire(&wait_lock);
+
+  // join() or threadkill() might be sleeping.
+  wakeup(p->leader);
+
+  acquire(&p->lock);
+
+  p->xstate = status;
+  p->state = ZOMBIE;
+
+  release(&wait_lock);
+
+  sched();
+  panic("zombie exit");
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -742,7 +1225,7 @@ forkret(void)
 
   // return to user space, mimicing usertrap()'s return.
   prepare_return();
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmsatp(p);
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
@@ -785,7 +1268,8 @@ wakeup(void *chan)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  procscan();
+  for(p = allproc; p != 0; p = p->allnext) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
@@ -795,6 +1279,7 @@ wakeup(void *chan)
       release(&p->lock);
     }
   }
+  procscandone();
 }
 
 // Kill the process with the given pid.
@@ -805,19 +1290,22 @@ kkill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  procscan();
+  for(p = allproc; p != 0; p = p->allnext){
     acquire(&p->lock);
-    if(p->pid == pid){
+    if(p->pid == pid && p->kfn == 0){
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
         p->state = RUNNABLE;
       }
       release(&p->lock);
+      procscandone();
       return 0;
     }
     release(&p->lock);
   }
+  procscandone();
   return -1;
 }
 
@@ -888,7 +1376,8 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  procscan();
+  for(p = allproc; p != 0; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -898,4 +1387,5 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  procscandone();
 }
@@ -27,6 +27,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint asidmax;               // Largest ASID; 0 if the hart has none.
+  uint asidnext;              // Next ASID to hand out.
+  uint64 asidgen;             // Generation of the ASIDs handed out.
 };
 
 extern struct cpu cpus[NCPU];
@@ -112,6 +115,31 @@ struct procinfo {
 };
 
 // Per-process state
+// A cached translation of a user page, for copyin() and
+// copyout(); see utlblookup() in vm.c.
+struct utlbent {
+  uint64 va;                   // user page address
+  uint64 pa;                   // physical page; 0 if unused
+  uint64 flags;                // PTE flags
+};
+
+// A file-backed region of the address space, mapped by mmap()
+// or, for a program segment, by exec().
+struct vma {
+  uint64 addr;                 // page-aligned start
+  uint64 len;                  // page-aligned length; 0 if unused
+  int prot;                    // PROT_READ, &c
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, maybe VMA_SEGMENT
+  struct inode *ip;            // mapped file
+  uint off;                    // file offset of addr
+  uint64 filesz;               // bytes backed by the file; the rest is zero
+};
+
+// vma.flags: a program segment from exec(). It lies below p->sz,
+// so its pages are freed, copied by fork, &c along with the rest
+// of the process's memory; the vma only says where to find them.
+#define VMA_SEGMENT 0x100
+
 struct proc {
   struct spinlock lock;
 
@@ -122,18 +150,41 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *leader;         // Process whose memory and files a clone()d
+                               // thread shares; a process's own is itself
+  uint tslots;                 // leader: THREADTF() slots its threads hold
+  int tdying;                  // leader: exit() or exec() is ending its threads
 
   // these are private to the process, so p->lock need not be held.
+  // a thread uses its leader's sz, ofile[], cwd, vma[] and ring.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // user address of trapframe
+  int tslot;                   // a thread's THREADTF() slot
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  struct utlbent utlb[NUTLB];  // recent user translations
+  uint64 utlbgen;              // uvmgen when utlb[] was filled
+  int utlbnext;                // utlb[] entry to replace next
+  uint64 asid[NCPU];           // per hart: generation << 16 | ASID
+  struct vma vma[NVMA];        // mmap()ed regions
+  struct ring *ring;           // ringsetup() page, or 0
+  int cloned;                  // THREADTF() slots are reserved
+  struct spinlock tlock;       // leader: guards page table changes, sz,
+                               // vma[], ofile[] and ringbusy among its threads
+  int ringbusy;                // leader: a thread is in ringenter()
+  void (*kfn)(void);           // body of a kernel thread (kproc())
+
+  // aio.lock must be held when using these:
+  struct aioreq *aio;          // asynchronous I/O requests (aio.c)
+  int naio;                    // how many
+  int aionext;                 // id for the next one
 
   // MLFQ scheduling fields
   int queue_level;             // Current queue level (0=highest priority)
@@ -141,6 +192,16 @@ struct proc {
   uint64 time_slices;          // Total CPU time slices received
   int entered_queue_tick;      // Tick when process entered current queue
   struct proc *queue_next;     // Next process in queue (for queue management)
+
+  // the futex.c bucket's lock must be held when using these:
+  uint64 fkey;                 // address waited on in futexwait(), or 0
+  struct proc *fnext;          // next waiter in the bucket
+
+  // procpool.lock must be held when using this:
+  struct proc *freenext;       // Next UNUSED proc in the pool's free list
+
+  // procpool.lock must be held to change this, but not to read it:
+  struct proc *allnext;        // Next proc in allproc
 };
 
 #endif
@@ -0,0 +1,176 @@
+//
+// Batched system calls, so that a process doing many small file
+// operations can pay for one trap instead of one per operation.
+//
+// ringsetup() gives the process a page shared with the kernel,
+// mapped at RING just below the trapframe, holding a ring of
+// requests and a ring of completions (struct ring in ring.h).
+// The process queues requests and calls ringenter(n), which
+// carries out up to n of them in order, as the corresponding
+// system calls would, and posts a completion for each; it stops
+// early if the completion ring fills up. The kernel reaches the
+// page through its own mapping, p->ring, so no copyin() is
+// needed; it reads each request once, into a private copy, and
+// uses the indices only modulo NRING, so a process that
+// scribbles on the page can only confuse itself.
+//
+// fork() copies the page to the child; exec() drops it.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "ring.h"
+#include "defs.h"
+
+// Map a ring page into p, if it doesn't have one yet.
+// Returns its user address, or -1.
+uint64
+ringsetup(struct proc *p)
+{
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  acquire(&p->tlock);
+  if(p->ring){
+    release(&p->tlock);
+    kfree(mem);
+    return RING;
+  }
+  // the heap or a mapped region may already be there.
+  if(PGROUNDUP(p->sz) > RING || vmalookup(p, RING) != 0 ||
+     mappages(p->pagetable, RING, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    release(&p->tlock);
+    kfree(mem);
+    return -1;
+  }
+  p->ring = (struct ring*)mem;
+  release(&p->tlock);
+  return RING;
+}
+
+// Give child np a copy of p's ring page.
+// Returns 0, or -1.
+int
+ringcopy(struct proc *p, struct proc *np)
+{
+  char *mem;
+
+  if(p->ring == 0)
+    return 0;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, p->ring, PGSIZE);
+  if(mappages(np->pagetable, RING, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  np->ring = (struct ring*)mem;
+  return 0;
+}
+
+// Carry out request e for p, returning the result.
+static int
+ringop(struct proc *p, struct ringsqe *e)
+{
+  char path[MAXPATH];
+  struct file *f;
+  struct iovec iov;
+  int r;
+
+  switch(e->op){
+  case RING_NOP:
+    return 0;
+  case RING_OPEN:
+    if(fetchstr(e->addr, path, MAXPATH) < 0)
+      return -1;
+    return kopen(path, e->n);
+  case RING_CLOSE:
+    if((f = fdtake(p, e->fd)) == 0)
+      return -1;
+    fileclose(f);
+    return 0;
+  }
+
+  // as for a system call, hold a reference of our own to the file
+  // in case another thread closes the descriptor meanwhile.
+  if((f = fdget(p, e->fd)) == 0)
+    return -1;
+  r = -1;
+  switch(e->op){
+  case RING_READ:
+  case RING_WRITE:
+    if(e->n < 0)
+      break;
+    iov.iov_base = (void*)e->addr;
+    iov.iov_len = e->n;
+    if(e->op == RING_READ)
+      r = filereadv(f, &iov, 1, e->off >= 0, e->off);
+    else
+      r = filewritev(f, &iov, 1, e->off >= 0, e->off);
+    break;
+  case RING_FSTAT:
+    r = filestat(f, e->addr);
+    break;
+  }
+  fileclose(f);
+  return r;
+}
+
+// Carry out up to n of p's queued requests, for the current
+// thread; p is its leader, which owns the ring and the files.
+// Only one of p's threads works on the ring at a time, since
+// sqhead and cqtail are read and advanced without a lock; the
+// others wait in ringenter() for their turn.
+// Returns the number done, or -1 if p has no ring.
+int
+ringenter(struct proc *p, int n)
+{
+  struct ring *r = p->ring;
+  struct ringsqe e;
+  struct ringcqe *c;
+  uint head;
+  int done;
+
+  if(r == 0)
+    return -1;
+  acquire(&p->tlock);
+  while(p->ringbusy){
+    if(killed(myproc())){
+      release(&p->tlock);
+      return -1;
+    }
+    sleep(&p->ringbusy, &p->tlock);
+  }
+  p->ringbusy = 1;
+  release(&p->tlock);
+
+  for(done = 0; done < n && !killed(myproc()); done++){
+    head = r->sqhead;
+    if(head == r->sqtail || r->cqtail - r->cqhead >= NRING)
+      break;
+    __sync_synchronize();  // read the request after seeing sqtail
+    e = r->sq[head % NRING];
+    r->sqhead = head + 1;
+    c = &r->cq[r->cqtail % NRING];
+    c->tag = e.tag;
+    c->res = ringop(p, &e);
+    __sync_synchronize();  // fill in the completion before it shows
+    r->cqtail++;
+  }
+
+  acquire(&p->tlock);
+  p->ringbusy = 0;
+  release(&p->tlock);
+  wakeup(&p->ringbusy);
+  return done;
+}
@@ -0,0 +1,42 @@
+// Batched system calls: the page that ringsetup() maps at RING.
+// See ring.c.
+
+#define NRING 32  // entries in each ring
+
+// ringsqe.op
+#define RING_NOP    0
+#define RING_READ   1
+#define RING_WRITE  2
+#define RING_OPEN   3
+#define RING_CLOSE  4
+#define RING_FSTAT  5
+
+// A request.
+struct ringsqe {
+  int op;
+  int fd;
+  uint64 addr;  // buffer; path for RING_OPEN; struct stat* for RING_FSTAT
+  int n;        // byte count; flags for RING_OPEN
+  int off;      // RING_READ, RING_WRITE: file offset, or -1 for the current one
+  uint64 tag;   // handed back in the completion
+};
+
+// A completion: res is what the system call would have returned.
+struct ringcqe {
+  uint64 tag;
+  int res;
+  int pad;
+};
+
+// The process adds requests at sq[sqtail % NRING] and the kernel
+// takes them from sqhead; the kernel adds completions at
+// cq[cqtail % NRING] and the process takes them from cqhead.
+// Each side writes only the indices it advances.
+struct ring {
+  uint sqhead;
+  uint sqtail;
+  uint cqhead;
+  uint cqtail;
+  struct ringsqe sq[NRING];
+  struct ringcqe cq[NRING];
+};
@@ -0,0 +1,287 @@
+// Small-object allocator, layered on kalloc().
+//
+// kmalloc(n) rounds n up to one of the size classes in
+// kmsizes[] and returns an object carved from a slab: a page
+// from kalloc() that starts with a struct slab header and whose
+// remainder is cut into objects of the class size. kmfree()
+// finds an object's slab by rounding its address down to a
+// page boundary. Requests bigger than the largest class get a
+// whole page from kalloc(); since slab objects never start on a
+// page boundary, kmfree() can tell the two apart.
+//
+// Each CPU keeps a small stack of free objects for every class,
+// so most kmalloc()/kmfree() calls touch no shared lock. A stack
+// is refilled from, or drained back to, the class's slabs half a
+// stack at a time, holding the class lock. A stack has a lock of
+// its own too, but only kmreclaim() takes it from another CPU.
+//
+// A slab whose objects are all free is handed back to kalloc(),
+// unless it is the only slab the class has. When kalloc() runs
+// out of pages it calls kmreclaim(), which empties every CPU's
+// stacks and hands back all the free slabs, kept ones included.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+
+#define KMCACHE 16  // free objects per CPU per class
+
+static const uint kmsizes[] = { 16, 32, 64, 128, 256, 384, 512, 768, 1024 };
+#define NKMCLASS NELEM(kmsizes)
+
+struct kmobj {
+  struct kmobj *next;
+};
+
+// Header at the start of each slab page.
+struct slab {
+  struct slab *next;     // class's list of slabs with free objects
+  struct slab *prev;
+  struct kmobj *free;    // free objects in this slab
+  int class;             // index into kmsizes[]
+  int nfree;             // number of objects on free
+  int nobj;              // objects in this slab
+};
+
+struct kmclass {
+  struct spinlock lock;
+  struct slab partial;   // list head: slabs with at least one free object
+  int nslab;             // slabs owned by this class
+};
+
+// Per-CPU stacks of free objects.
+struct kmcache {
+  struct spinlock lock;
+  int n;
+  void *obj[KMCACHE];
+};
+
+static struct kmclass kmclass[NKMCLASS];
+static struct kmcache kmcache[NCPU][NKMCLASS];
+
+void
+kminit(void)
+{
+  for(int c = 0; c < NKMCLASS; c++){
+    initlock(&kmclass[c].lock, "kmclass");
+    kmclass[c].partial.next = &kmclass[c].partial;
+    kmclass[c].partial.prev = &kmclass[c].partial;
+    for(int i = 0; i < NCPU; i++)
+      initlock(&kmcache[i][c].lock, "kmcache");
+  }
+}
+
+static int
+kmsizeclass(uint n)
+{
+  for(int c = 0; c < NKMCLASS; c++)
+    if(n <= kmsizes[c])
+      return c;
+  return -1;
+}
+
+static void
+slab_unlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+slab_push(struct kmclass *kc, struct slab *s)
+{
+  s->next = kc->partial.next;
+  s->prev = &kc->partial;
+  kc->partial.next->prev = s;
+  kc->partial.next = s;
+}
+
+// Allocate a new slab for class c and add it to the partial list.
+// Caller must hold kmclass[c].lock.
+// Returns 0 if out of memory.
+static struct slab*
+slab_new(int c)
+{
+  struct kmclass *kc = &kmclass[c];
+  struct slab *s;
+  struct kmobj *o;
+  char *p;
+  uint sz = kmsizes[c];
+
+  // kmreclaim() would need the locks held here.
+  if((s = (struct slab*)kallocnoreclaim()) == 0)
+    return 0;
+  s->class = c;
+  s->free = 0;
+  s->nobj = 0;
+  // objects begin at the first multiple of 16 after the header.
+  for(p = (char*)s + ((sizeof(struct slab) + 15) & ~15);
+      p + sz <= (char*)s + PGSIZE; p += sz){
+    o = (struct kmobj*)p;
+    o->next = s->free;
+    s->free = o;
+    s->nobj++;
+  }
+  s->nfree = s->nobj;
+  slab_push(kc, s);
+  kc->nslab++;
+  return s;
+}
+
+// Move up to n objects of class c from its slabs into out[].
+// Returns the number moved; fewer than n only if out of memory.
+static int
+kmrefill(int c, void **out, int n)
+{
+  struct kmclass *kc = &kmclass[c];
+  struct slab *s;
+  int got = 0;
+
+  acquire(&kc->lock);
+  while(got < n){
+    s = kc->partial.next;
+    if(s == &kc->partial && (s = slab_new(c)) == 0)
+      break;
+    while(got < n && s->free){
+      out[got++] = s->free;
+      s->free = s->free->next;
+      s->nfree--;
+    }
+    if(s->free == 0)
+      slab_unlink(s);
+  }
+  release(&kc->lock);
+  return got;
+}
+
+// Return n objects of class c from objs[] to their slabs.
+static void
+kmdrain(int c, void **objs, int n)
+{
+  struct kmclass *kc = &kmclass[c];
+  struct slab *s;
+  struct kmobj *o;
+
+  acquire(&kc->lock);
+  for(int i = 0; i < n; i++){
+    o = (struct kmobj*)objs[i];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->class != c)
+      panic("kmfree: class");
+    if(s->free == 0)
+      slab_push(kc, s);   // was full; now partial again.
+    o->next = s->free;
+    s->free = o;
+    s->nfree++;
+    if(s->nfree == s->nobj && kc->nslab > 1){
+      slab_unlink(s);
+      kc->nslab--;
+      kfree((void*)s);
+    }
+  }
+  release(&kc->lock);
+}
+
+// Allocate n bytes of kernel memory.
+// Returns a pointer that the kernel can use,
+// or 0 if the memory cannot be allocated.
+// The result is at least 16-byte aligned.
+void*
+kmalloc(uint n)
+{
+  struct kmcache *kc;
+  void *p;
+  int c;
+
+  if(n == 0 || n > PGSIZE)
+    return 0;
+  if((c = kmsizeclass(n)) < 0)
+    return kalloc();
+
+  push_off();
+  kc = &kmcache[cpuid()][c];
+  acquire(&kc->lock);
+  if(kc->n == 0)
+    kc->n = kmrefill(c, kc->obj, KMCACHE/2);
+  p = kc->n > 0 ? kc->obj[--kc->n] : 0;
+  release(&kc->lock);
+  pop_off();
+
+  if(p)
+    memset(p, 5, kmsizes[c]); // fill with junk
+  return p;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct kmcache *kc;
+  struct slab *s;
+  int c;
+
+  if(((uint64)p % PGSIZE) == 0){
+    kfree(p);
+    return;
+  }
+
+  s = (struct slab*)PGROUNDDOWN((uint64)p);
+  c = s->class;
+  if(c < 0 || c >= NKMCLASS)
+    panic("kmfree");
+
+  // Fill with junk to catch dangling refs.
+  memset(p, 1, kmsizes[c]);
+
+  push_off();
+  kc = &kmcache[cpuid()][c];
+  acquire(&kc->lock);
+  if(kc->n == KMCACHE){
+    kmdrain(c, &kc->obj[KMCACHE/2], KMCACHE/2);
+    kc->n = KMCACHE/2;
+  }
+  kc->obj[kc->n++] = p;
+  release(&kc->lock);
+  pop_off();
+}
+
+// Return every CPU's cached objects to their slabs, and give
+// every slab with no objects in use back to kalloc().
+// Called by kalloc() when it has no free pages.
+// Returns the number of pages given back.
+int
+kmreclaim(void)
+{
+  struct kmcache *kc;
+  struct kmclass *cl;
+  struct slab *s, *next;
+  int n = 0;
+
+  for(int c = 0; c < NKMCLASS; c++){
+    for(int i = 0; i < NCPU; i++){
+      kc = &kmcache[i][c];
+      acquire(&kc->lock);
+      kmdrain(c, kc->obj, kc->n);
+      kc->n = 0;
+      release(&kc->lock);
+    }
+
+    cl = &kmclass[c];
+    acquire(&cl->lock);
+    for(s = cl->partial.next; s != &cl->partial; s = next){
+      next = s->next;
+      if(s->nfree == s->nobj){
+        slab_unlink(s);
+        cl->nslab--;
+        kfree((void*)s);
+        n++;
+      }
+    }
+    release(&cl->lock);
+  }
+  return n;
+}
@@ -6,6 +6,9 @@
 
 void main();
 void timerinit();
+#ifdef RVV
+extern int rvv;
+#endif
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
@@ -40,6 +43,13 @@ start()
   // ask for clock interrupts.
   timerinit();
 
+#ifdef RVV
+  // let memmove() and friends use the vector unit; misa can
+  // only be read in machine mode.
+  if(r_misa() & MISA_EXT('V'))
+    rvv = 1;
+#endif
+
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
   w_tp(id);
@@ -1,13 +1,137 @@
 #include "types.h"
+#ifdef RVV
+#include "riscv.h"
+#include "defs.h"
+#endif
+
+// memset(), memmove() and memcmp() work a 64-bit word at a time
+// once the pointers are 8-byte aligned, four words per loop
+// iteration where they can. If two pointers are not equally
+// aligned, one of them can't be accessed a word at a time, and
+// they stay with bytes: RISC-V traps or is slow on misaligned
+// loads and stores.
+//
+// A kernel built with RVV=1 (see the Makefile) hands large
+// requests to the vector unit instead, if start() found one.
+
+#define WSIZE sizeof(uint64)
+#define ALIGNED(p) (((uint64)(p) & (WSIZE-1)) == 0)
+#define COALIGNED(p, q) ((((uint64)(p) ^ (uint64)(q)) & (WSIZE-1)) == 0)
+
+#ifdef RVV
+int rvv;            // set by start() if the harts have the V extension
+
+#define RVVMIN 128  // shorter requests aren't worth it
+
+// The kernel does not save vector registers when it switches
+// processes, so the vector unit is only switched on with
+// interrupts off, and off again before anything else can run.
+// User code that tries a vector instruction still traps.
+static void
+vbegin(void)
+{
+  push_off();
+  w_sstatus((r_sstatus() & ~SSTATUS_VS) | SSTATUS_VS_INITIAL);
+}
+
+static void
+vend(void)
+{
+  w_sstatus(r_sstatus() & ~SSTATUS_VS);
+  pop_off();
+}
+
+static void
+vset(uchar *d, int c, uint n)
+{
+  uint64 vl;
+
+  vbegin();
+  for(; n > 0; n -= vl, d += vl){
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma\n"
+                 "vmv.v.x v0, %2\n"
+                 "vse8.v v0, (%3)"
+                 : "=&r" (vl) : "r" (n), "r" (c), "r" (d) : "memory");
+  }
+  vend();
+}
+
+// Copy upwards; safe for overlap if d is below s, since each
+// chunk is loaded in full before any of it is stored.
+static void
+vcopy(uchar *d, const uchar *s, uint n)
+{
+  uint64 vl;
+
+  vbegin();
+  for(; n > 0; n -= vl, d += vl, s += vl){
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma\n"
+                 "vle8.v v0, (%2)\n"
+                 "vse8.v v0, (%3)"
+                 : "=&r" (vl) : "r" (n), "r" (s), "r" (d) : "memory");
+  }
+  vend();
+}
+
+static int
+vcmp(const uchar *s1, const uchar *s2, uint n)
+{
+  uint64 vl;
+  long i;
+  int r = 0;
+
+  vbegin();
+  for(; n > 0; n -= vl, s1 += vl, s2 += vl){
+    asm volatile("vsetvli %0, %2, e8, m8, ta, ma\n"
+                 "vle8.v v0, (%3)\n"
+                 "vle8.v v8, (%4)\n"
+                 "vmsne.vv v16, v0, v8\n"
+                 "vfirst.m %1, v16"
+                 : "=&r" (vl), "=&r" (i)
+                 : "r" (n), "r" (s1), "r" (s2) : "memory");
+    if(i >= 0){
+      r = s1[i] - s2[i];
+      break;
+    }
+  }
+  vend();
+  return r;
+}
+#endif
 
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = (uchar *) dst;
+  uint64 w, *wd;
+
+#ifdef RVV
+  if(rvv && n >= RVVMIN){
+    vset(d, c, n);
+    return dst;
+  }
+#endif
+
+  for(; n > 0 && !ALIGNED(d); n--)
+    *d++ = c;
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64*)d;
+    for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4){
+      wd[0] = w;
+      wd[1] = w;
+      wd[2] = w;
+      wd[3] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar*)wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +142,18 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+#ifdef RVV
+  if(rvv && n >= RVVMIN)
+    return vcmp(s1, s2, n);
+#endif
+  if(COALIGNED(s1, s2)){
+    for(; n > 0 && !ALIGNED(s1); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip equal words; the loop below finds the differing byte.
+    for(; n >= WSIZE && *(uint64*)s1 == *(uint64*)s2; n -= WSIZE)
+      s1 += WSIZE, s2 += WSIZE;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -30,8 +166,10 @@ memcmp(const void *v1, const void *v2, uint n)
 void*
 memmove(void *dst, const void *src, uint n)
 {
-  const char *s;
-  char *d;
+  const uchar *s;
+  uchar *d;
+  const uint64 *ws;
+  uint64 *wd;
 
   if(n == 0)
     return dst;
@@ -39,13 +177,56 @@ memmove(void *dst, const void *src, uint n)
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // dst overlaps the end of src: copy downwards. Within a
+    // group of four words the highest goes first, so nothing
+    // is overwritten before it has been read.
     s += n;
     d += n;
+    if(COALIGNED(s, d)){
+      for(; n > 0 && !ALIGNED(d); n--)
+        *--d = *--s;
+      wd = (uint64*)d;
+      ws = (const uint64*)s;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        wd -= 4, ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      d = (uchar*)wd;
+      s = (const uchar*)ws;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+#ifdef RVV
+    if(rvv && n >= RVVMIN){
+      vcopy(d, s, n);
+      return dst;
+    }
+#endif
+    if(COALIGNED(s, d)){
+      for(; n > 0 && !ALIGNED(d); n--)
+        *d++ = *s++;
+      wd = (uint64*)d;
+      ws = (const uint64*)s;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4, ws += 4){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      d = (uchar*)wd;
+      s = (const uchar*)ws;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -12,7 +12,7 @@ int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
+  if(addr >= p->leader->sz || addr+sizeof(uint64) > p->leader->sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -104,6 +104,22 @@ extern uint64 sys_close(void);
 extern uint64 sys_getprocinfo(void);
 extern uint64 sys_boostproc(void);  // Week 3: Manual priority boost
 extern uint64 sys_getschedulerstats(void);  // Week 3: Retrieve scheduler statistics
+extern uint64 sys_splice(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_ringsetup(void);
+extern uint64 sys_ringenter(void);
+extern uint64 sys_aioread(void);
+extern uint64 sys_aiowrite(void);
+extern uint64 sys_aiowait(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -132,6 +148,22 @@ static uint64 (*syscalls[])(void) = {
 [SYS_getprocinfo] sys_getprocinfo,
 [SYS_boostproc] sys_boostproc,  // Week 3
 [SYS_getschedulerstats] sys_getschedulerstats,  // Week 3
+[SYS_splice] sys_splice,
+[SYS_mmap] sys_mmap,
+[SYS_munmap] sys_munmap,
+[SYS_madvise] sys_madvise,
+[SYS_pread] sys_pread,
+[SYS_pwrite] sys_pwrite,
+[SYS_readv] sys_readv,
+[SYS_writev] sys_writev,
+[SYS_ringsetup] sys_ringsetup,
+[SYS_ringenter] sys_ringenter,
+[SYS_aioread] sys_aioread,
+[SYS_aiowrite] sys_aiowrite,
+[SYS_aiowait] sys_aiowait,
+[SYS_clone] sys_clone,
+[SYS_join] sys_join,
+[SYS_futex] sys_futex,
 
 };
 
@@ -23,3 +23,19 @@
 #define SYS_getprocinfo 22
 #define SYS_boostproc 23
 #define SYS_getschedulerstats 24
+#define SYS_splice 25
+#define SYS_mmap 26
+#define SYS_munmap 27
+#define SYS_madvise 28
+#define SYS_pread 29
+#define SYS_pwrite 30
+#define SYS_readv 31
+#define SYS_writev 32
+#define SYS_ringsetup 33
+#define SYS_ringenter 34
+#define SYS_aioread 35
+#define SYS_aiowrite 36
+#define SYS_aiowait 37
+#define SYS_clone 38
+#define SYS_join 39
+#define SYS_futex 40
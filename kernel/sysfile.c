@@ -16,21 +16,55 @@
 #include "file.h"
 #include "fcntl.h"
 
+// The threads of a process share its leader's ofile[], so one
+// may close a descriptor while another is using its file. fdget()
+// gives the user of a file a reference of its own, and fdtake()
+// empties the slot in the same step as it takes the file out, both
+// under the leader's tlock.
+
+// Return the file open as p's descriptor fd, with a new reference
+// that the caller must drop with fileclose(), or 0.
+struct file*
+fdget(struct proc *p, int fd)
+{
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&p->tlock);
+  if((f = p->ofile[fd]) != 0)
+    filedup(f);
+  release(&p->tlock);
+  return f;
+}
+
+// Close p's descriptor fd, returning its file, whose reference
+// passes to the caller, or 0.
+struct file*
+fdtake(struct proc *p, int fd)
+{
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&p->tlock);
+  f = p->ofile[fd];
+  p->ofile[fd] = 0;
+  release(&p->tlock);
+  return f;
+}
+
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return the corresponding struct file, with a reference from
+// fdget() that the caller must drop.
 static int
-argfd(int n, int *pfd, struct file **pf)
+argfd(int n, struct file **pf)
 {
   int fd;
-  struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((*pf = fdget(myproc()->leader, fd)) == 0)
     return -1;
-  if(pfd)
-    *pfd = fd;
-  if(pf)
-    *pf = f;
   return 0;
 }
 
@@ -40,14 +74,17 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
+  acquire(&p->tlock);
   for(fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
+      release(&p->tlock);
       return fd;
     }
   }
+  release(&p->tlock);
   return -1;
 }
 
@@ -57,11 +94,11 @@ sys_dup(void)
   struct file *f;
   int fd;
 
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f) < 0)
     return -1;
+  // the new descriptor takes over argfd()'s reference.
   if((fd=fdalloc(f)) < 0)
-    return -1;
-  filedup(f);
+    fileclose(f);
   return fd;
 }
 
@@ -69,29 +106,224 @@ uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
   
   argaddr(1, &p);
   argint(2, &n);
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f) < 0)
+    return -1;
+
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+  struct iovec iov;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(n < 0 || off < 0 || argfd(0, &f) < 0)
+    return -1;
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  r = filereadv(f, &iov, 1, 1, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+  struct iovec iov;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(n < 0 || off < 0 || argfd(0, &f) < 0)
+    return -1;
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  r = filewritev(f, &iov, 1, 1, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_aioread(void)
+{
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, &f) < 0)
+    return -1;
+  r = aiosubmit(myproc(), 0, f, p, n, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_aiowrite(void)
+{
+  struct file *f;
+  int n, off, r;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, &f) < 0)
+    return -1;
+  r = aiosubmit(myproc(), 1, f, p, n, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_aiowait(void)
+{
+  int id, block;
+  uint64 res;
+
+  argint(0, &id);
+  argint(1, &block);
+  argaddr(2, &res);
+  return aiowait(myproc(), id, block, res);
+}
+
+// Fetch the iovcnt iovecs at user address uiov for readv() or
+// writev(). Returns 0, or -1 if there are too many, or they add
+// up to more than a read() or write() could return.
+static int
+argiov(struct iovec *iov, uint64 uiov, int iovcnt)
+{
+  int i;
+  uint64 tot;
+
+  if(iovcnt < 0 || iovcnt > NIOV)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, uiov, iovcnt*sizeof(*iov)) < 0)
     return -1;
+  tot = 0;
+  for(i = 0; i < iovcnt; i++)
+    tot += iov[i].iov_len;
+  if(tot > 0x7fffffff)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[NIOV];
+  int iovcnt, r;
+  uint64 uiov;
+
+  argaddr(1, &uiov);
+  argint(2, &iovcnt);
+  if(argiov(iov, uiov, iovcnt) < 0 || argfd(0, &f) < 0)
+    return -1;
+  r = filereadv(f, iov, iovcnt, 0, 0);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[NIOV];
+  int iovcnt, r;
+  uint64 uiov;
+
+  argaddr(1, &uiov);
+  argint(2, &iovcnt);
+  if(argiov(iov, uiov, iovcnt) < 0 || argfd(0, &f) < 0)
+    return -1;
+  r = filewritev(f, iov, iovcnt, 0, 0);
+  fileclose(f);
+  return r;
+}
 
-  return filewrite(f, p, n);
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  uint64 len, r;
+  int prot, flags, off;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(argfd(4, &f) < 0)
+    return -1;
+  r = mmap(len, prot, flags, f, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  // see threaded().
+  if(threaded(myproc()))
+    return -1;
+  return munmap(myproc()->leader, addr, len);
+}
+
+uint64
+sys_splice(void)
+{
+  struct file *fin, *fout;
+  int n, r;
+
+  argint(2, &n);
+  if(argfd(0, &fin) < 0)
+    return -1;
+  if(argfd(1, &fout) < 0){
+    fileclose(fin);
+    return -1;
+  }
+  r = filesplice(fin, fout, n);
+  fileclose(fin);
+  fileclose(fout);
+  return r;
 }
 
 uint64
@@ -100,9 +332,9 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  argint(0, &fd);
+  if((f = fdtake(myproc()->leader, fd)) == 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -111,12 +343,15 @@ uint64
 sys_fstat(void)
 {
   struct file *f;
+  int r;
   uint64 st; // user pointer to struct stat
 
   argaddr(1, &st);
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -173,14 +408,15 @@ bad:
 static int
 isdirempty(struct inode *dp)
 {
-  int off;
-  struct dirent de;
+  struct diriter it;
+  struct dirent *de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
+  diropen(&it, dp, 2*sizeof(*de));
+  while((de = dirnext(&it)) != 0){
+    if(de->inum != 0){
+      dirclose(&it);
       return 0;
+    }
   }
   return 1;
 }
@@ -222,6 +458,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheput(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -301,18 +538,14 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path for the current process, as open() does.
+// Returns the new file descriptor, or -1.
+int
+kopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -341,6 +574,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program can't be changed; see mmap.c.
+  if(ip->nexec > 0 && (omode & (O_WRONLY|O_RDWR|O_TRUNC))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -370,6 +610,33 @@ sys_open(void)
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  return kopen(path, omode);
+}
+
+uint64
+sys_ringsetup(void)
+{
+  return ringsetup(myproc()->leader);
+}
+
+uint64
+sys_ringenter(void)
+{
+  int n;
+
+  argint(0, &n);
+  return ringenter(myproc()->leader, n);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -411,7 +678,7 @@ sys_chdir(void)
 {
   char path[MAXPATH];
   struct inode *ip;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   
   begin_op();
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
@@ -480,7 +747,7 @@ sys_pipe(void)
   uint64 fdarray; // user pointer to array of two integers
   struct file *rf, *wf;
   int fd0, fd1;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   argaddr(0, &fdarray);
   if(pipealloc(&rf, &wf) < 0)
@@ -488,17 +755,19 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+      rf = fdtake(p, fd0);
+    if(rf)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    // another thread may have closed them already.
+    if((rf = fdtake(p, fd0)) != 0)
+      fileclose(rf);
+    if((wf = fdtake(p, fd1)) != 0)
+      fileclose(wf);
     return -1;
   }
   return 0;
@@ -6,9 +6,10 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "vm.h"
+#include "fcntl.h"
 
 // External declarations for MLFQ scheduler
-extern struct proc proc[NPROC];
+extern struct proc *allproc;
 extern struct mlfq_stats scheduler_stats;
 extern struct spinlock stats_lock;
 
@@ -47,28 +48,102 @@ sys_sbrk(void)
   uint64 addr;
   int t;
   int n;
+  struct proc *p = myproc()->leader;
 
   argint(0, &n);
   argint(1, &t);
-  addr = myproc()->sz;
 
-  if(t == SBRK_EAGER || n < 0) {
-    if(growproc(n) < 0) {
+  if(t == SBRK_EAGER || t == SBRK_HUGE || n < 0) {
+    if((addr = growproc(n, t == SBRK_HUGE)) == -1) {
       return -1;
     }
   } else {
     // Lazily allocate memory for this process: increase its memory
     // size but don't allocate memory. If the processes uses the
     // memory, vmfault() will allocate it.
-    if(addr + n < addr)
+    acquire(&p->tlock);
+    addr = p->sz;
+    if(addr + n < addr || addr + n > mmapbase(p)) {
+      release(&p->tlock);
       return -1;
-    if(addr + n > TRAPFRAME)
-      return -1;
-    myproc()->sz += n;
+    }
+    p->sz += n;
+    release(&p->tlock);
   }
   return addr;
 }
 
+// madvise(addr, len, advice): MADV_DONTNEED gives the heap
+// pages of [addr, addr+len) back; they read as zero when next
+// touched, or as the file's contents in a program segment.
+uint64
+sys_madvise(void)
+{
+  uint64 addr, len;
+  int advice;
+  struct proc *p = myproc();
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &advice);
+
+  if(advice == MADV_NORMAL)
+    return 0;
+  if(advice != MADV_DONTNEED)
+    return -1;
+  // see threaded().
+  if(threaded(p))
+    return -1;
+  p = p->leader;
+  if(addr % PGSIZE != 0 || addr + len < addr || addr + len > p->sz)
+    return -1;
+  return uvmdiscard(p->pagetable, addr, PGROUNDUP(len));
+}
+
+// clone(fn, arg, stack): start a thread running fn(arg) on the
+// stack whose top is at stack. Returns its pid.
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return kclone(fn, arg, stack);
+}
+
+// join(tid, &status): wait for thread tid, or any thread if tid
+// is 0, to exit.
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  argint(0, &tid);
+  argaddr(1, &p);
+  return kjoin(tid, p);
+}
+
+// futex(addr, op, val): FUTEX_WAIT sleeps while the int at addr
+// holds val; FUTEX_WAKE wakes up to val threads waiting on addr.
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+  if(op == FUTEX_WAIT)
+    return futexwait(addr, val);
+  if(op == FUTEX_WAKE)
+    return futexwake(addr, val);
+  return -1;
+}
+
 uint64
 sys_pause(void)
 {
@@ -155,17 +230,20 @@ sys_boostproc(void)
     return 0;
   } else {
     // Boost specific process
-    for(p = proc; p < &proc[NPROC]; p++) {
+    procscan();
+    for(p = allproc; p != 0; p = p->allnext) {
       acquire(&p->lock);
       if(p->pid == pid) {
         // Set to highest priority
         p->queue_level = 0;
         p->time_in_queue = 0;
         release(&p->lock);
+        procscandone();
         return 0;
       }
       release(&p->lock);
     }
+    procscandone();
     return -1;  // Process not found
   }
 }
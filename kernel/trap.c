@@ -71,9 +71,20 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if((r_scause() == 15 || r_scause() == 13) &&
-            vmfault(p->pagetable, r_stval(), (r_scause() == 13)? 1 : 0) != 0) {
-    // page fault on lazily-allocated page
+  } else if(r_scause() == 15 || r_scause() == 13 || r_scause() == 12){
+    // page fault on a lazily-allocated or mmap()ed page,
+    // or on a program page that exec() left on disk.
+    // reading in an mmap()ed page may sleep, so turn on
+    // interrupts, once done with the trap registers.
+    uint64 scause = r_scause();
+    uint64 stval = r_stval();
+    intr_on();
+    if(vmfault(p->pagetable, stval, (scause == 15)? 0 : 1) == 0 &&
+       !uvmspurious(p, stval, scause == 15 ? PTE_W : scause == 13 ? PTE_R : PTE_X)){
+      printf("usertrap(): unexpected scause 0x%lx pid=%d\n", scause, p->pid);
+      printf("            sepc=0x%lx stval=0x%lx\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -90,7 +101,7 @@ usertrap(void)
   prepare_return();
 
   // the user page table to switch to, for trampoline.S
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmsatp(p);
 
   // return to trampoline.S; satp value in a0.
   return satp;
@@ -131,6 +142,9 @@ prepare_return(void)
 
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
+
+  // tell trampoline.S where this thread's trapframe is.
+  w_sscratch(p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
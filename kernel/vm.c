@@ -17,6 +17,8 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -39,6 +41,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // kvmmap() uses megapages for most of it.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -51,13 +54,13 @@ kvmmake(void)
   return kpgtbl;
 }
 
-// add a mapping to the kernel page table.
-// only used when booting.
+// add a mapping to the kernel page table, with megapages
+// where it can. only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
+  if(mappagesmega(kpgtbl, va, sz, pa, perm) != 0)
     panic("kvmmap");
 }
 
@@ -78,10 +81,113 @@ kvminithart()
 
   w_satp(MAKE_SATP(kernel_pagetable));
 
+  // find out how many ASID bits the hart has: the ones that
+  // can be set.
+  w_satp(MAKE_SATP_ASID(kernel_pagetable, 0xFFFF));
+  mycpu()->asidmax = SATP_ASID(r_satp());
+  mycpu()->asidnext = 1;
+  mycpu()->asidgen = 1;
+  w_satp(MAKE_SATP(kernel_pagetable));
+
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Address-space IDs. The TLB tags each entry with the ASID in
+// satp, so user page tables that have their own ASIDs needn't
+// be flushed from the TLB on every trap and context switch, and
+// neither do the kernel's entries, which have ASID 0. Each hart
+// hands out ASIDs 1..asidmax, in order, to the processes that run
+// on it; p->asid[] records which ASID p has on each hart, and of
+// which generation. When a hart runs out, it starts a new
+// generation and flushes its whole TLB, so an ASID has no
+// entries when it is handed out. A process keeps its ASIDs until
+// then, or until its page table changes in a way the TLB could
+// miss.
+//
+// Removing or weakening a mapping (uvmunmap(), uvmclear()) calls
+// uvmflush(), which flushes those pages on this hart and forgets
+// the process's ASIDs on the others. Adding a mapping doesn't
+// flush anything; a fault on a page that has since been mapped
+// is retried by uvmspurious().
+//
+// A hart without ASIDs gives ASID 0 to every process, and
+// trampoline.S then flushes the whole TLB around every switch
+// between the user and kernel page tables.
+
+// The satp value for running p on this hart, giving p an ASID if
+// it has none here. Called with interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+
+  if(c->asidmax == 0)
+    return MAKE_SATP(p->pagetable);
+  if((p->asid[id] >> 16) != c->asidgen){
+    if(c->asidnext > c->asidmax){
+      c->asidgen++;
+      c->asidnext = 1;
+      sfence_vma();
+    }
+    p->asid[id] = (c->asidgen << 16) | c->asidnext++;
+  }
+  return MAKE_SATP_ASID(p->pagetable, p->asid[id] & 0xFFFF);
+}
+
+// npages of mappings from va in pagetable have been removed or
+// weakened. If it is the current process's, flush them from this
+// hart's TLB, and take away the process's ASIDs on other harts.
+static void
+uvmflush(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  struct proc *p = myproc();
+  uint64 a, asid;
+  int id;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;   // not running, so not in any TLB under its ASIDs.
+
+  push_off();
+  id = cpuid();
+  for(int i = 0; i < NCPU; i++)
+    if(i != id)
+      p->asid[i] = 0;
+  if(mycpu()->asidmax > 0 && (p->asid[id] >> 16) == mycpu()->asidgen){
+    asid = p->asid[id] & 0xFFFF;
+    if(npages > 64){
+      sfence_vma_asid(asid);
+    } else {
+      for(a = va; a < va + npages*PGSIZE; a += PGSIZE)
+        sfence_vma_page(a, asid);
+    }
+  }
+  pop_off();
+}
+
+// A user page fault at va, needing permission perm, on a page
+// that is mapped with perm: the TLB held an entry from before the
+// page was mapped. Flush it, so the access can be retried.
+// Returns 1 if so, 0 for a real fault.
+int
+uvmspurious(struct proc *p, uint64 va, uint64 perm)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA || (pte = walk(p->pagetable, va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_U|perm)) != (PTE_V|PTE_U|perm))
+    return 0;
+  push_off();
+  if((p->asid[cpuid()] >> 16) == mycpu()->asidgen)
+    sfence_vma_page(PGROUNDDOWN(va), p->asid[cpuid()] & 0xFFFF);
+  else
+    sfence_vma();
+  pop_off();
+  return 1;
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -94,15 +200,28 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid level-1 PTE with any of R, W or X set is itself a
+// leaf, mapping a 2-megabyte megapage; if va lies in one,
+// walk() returns that PTE, which has PTE_MEGA set.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at level, 0 or 1, for va.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
+{
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;   // a leaf above level
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -111,7 +230,17 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
+}
+
+// The physical address of the page that leaf PTE *pte,
+// found by walk(), maps va to.
+static uint64
+pteaddr(pte_t *pte, uint64 va)
+{
+  if(*pte & PTE_MEGA)
+    return PTE2PA(*pte) + (PGROUNDDOWN(va) & (MEGASIZE-1));
+  return PTE2PA(*pte);
 }
 
 // Look up a virtual address, return the physical address,
@@ -133,10 +262,96 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(pte, va);
   return pa;
 }
 
+// Each process caches a few translations of its own user pages
+// in p->utlb[], so that copyin(), copyout() and copyinstr() can
+// usually skip the page-table walk. Anything that removes a
+// user mapping or takes permissions away from one bumps uvmgen,
+// with utlbinval(); a process whose p->utlbgen doesn't match
+// empties its cache before using it. That is coarse, but
+// unmapping is rare next to copying, and the invalidation needs
+// no knowledge of which processes use which page table.
+static uint64 uvmgen = 1;
+
+void
+utlbinval(void)
+{
+  __sync_fetch_and_add(&uvmgen, 1);
+}
+
+// The kernel is about to write the user page at va0 through
+// its direct mapping, which doesn't set the PTE's dirty bit as
+// a user store would. Set it, so that munmap() writes a
+// MAP_SHARED page back, and in the translation cache.
+static void
+utlbdirty(pagetable_t pagetable, uint64 va0)
+{
+  struct proc *p = myproc();
+  struct utlbent *e;
+  pte_t *pte;
+
+  if((pte = walk(pagetable, va0, 0)) == 0 || (*pte & PTE_V) == 0)
+    return;
+  __sync_fetch_and_or(pte, PTE_A | PTE_D);
+  if(p == 0 || pagetable != p->pagetable)
+    return;
+  for(e = p->utlb; e < &p->utlb[NUTLB]; e++)
+    if(e->pa != 0 && e->va == va0)
+      e->flags |= PTE_A | PTE_D;
+}
+
+// Look up the user page at page-aligned va0 in pagetable,
+// through the current process's translation cache if pagetable
+// is its own. Sets *flags to the PTE's flags.
+// Return the physical address, or 0 if there is no user
+// mapping for va0.
+static uint64
+utlblookup(pagetable_t pagetable, uint64 va0, uint64 *flags)
+{
+  struct proc *p = myproc();
+  struct utlbent *e;
+  pte_t *pte;
+  uint64 gen;
+
+  if(va0 >= MAXVA)
+    return 0;
+
+  if(p == 0 || pagetable != p->pagetable){
+    pte = walk(pagetable, va0, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+      return 0;
+    *flags = PTE_FLAGS(*pte);
+    return pteaddr(pte, va0);
+  }
+
+  gen = uvmgen;
+  if(p->utlbgen != gen){
+    for(e = p->utlb; e < &p->utlb[NUTLB]; e++)
+      e->pa = 0;
+    p->utlbgen = gen;
+  }
+  for(e = p->utlb; e < &p->utlb[NUTLB]; e++){
+    if(e->pa != 0 && e->va == va0){
+      *flags = e->flags;
+      return e->pa;
+    }
+  }
+
+  pte = walk(pagetable, va0, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  e = &p->utlb[p->utlbnext];
+  p->utlbnext = (p->utlbnext + 1) % NUTLB;
+  e->va = va0;
+  e->pa = pteaddr(pte, va0);
+  e->flags = PTE_FLAGS(*pte);
+  *flags = e->flags;
+  return e->pa;
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
@@ -173,6 +388,43 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Like mappages(), but where va and pa are both megapage-aligned
+// and at least a megapage remains, map a whole megapage with one
+// level-1 PTE, unless there is already a level-0 page table for
+// it. For the kernel's direct map and kallocmega() memory.
+// Returns 0 on success, -1 if out of page-table pages.
+int
+mappagesmega(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
+{
+  uint64 a, n, end;
+  pte_t *pte;
+
+  if((va % PGSIZE) != 0 || (size % PGSIZE) != 0 || size == 0)
+    panic("mappagesmega");
+
+  end = va + size;
+  for(a = va; a < end; a += n, pa += n){
+    n = MEGASIZE;
+    if(a % MEGASIZE == 0 && pa % MEGASIZE == 0 && end - a >= MEGASIZE){
+      if(a >= MAXVA)
+        panic("mappagesmega: va");
+      if((pte = walklevel(pagetable, a, 1, 1)) == 0)
+        return -1;
+      if(*pte == 0){
+        *pte = PA2PTE(pa) | perm | PTE_MEGA | PTE_V;
+        continue;
+      }
+    }
+    // up to the next megapage boundary with 4096-byte pages.
+    n = MEGAROUNDDOWN(a) + MEGASIZE - a;
+    if(n > end - a)
+      n = end - a;
+    if(mappages(pagetable, a, n, pa, perm) != 0)
+      return -1;
+  }
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
@@ -188,27 +440,41 @@ uvmcreate()
 
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
+// A megapage must be removed whole; see uvmsplit().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, i;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
+  utlbinval();
+
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
       continue;   
     if((*pte & PTE_V) == 0)  // has physical page been allocated?
       continue;
+    if(*pte & PTE_MEGA){
+      if(a % MEGASIZE != 0 || a + MEGASIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of megapage");
+      if(do_free)
+        for(i = 0; i < MEGASIZE; i += PGSIZE)
+          kfree((void*)(PTE2PA(*pte) + i));
+      *pte = 0;
+      a += MEGASIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
   }
+  uvmflush(pagetable, va, npages);
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
@@ -239,6 +505,94 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   return newsz;
 }
 
+// Like uvmalloc(), but map each whole, aligned megapage of
+// [oldsz, newsz) with a megapage from kallocmega(), while the
+// pool lasts, and the rest with 4096-byte pages.
+// Returns new size or 0 on error.
+uint64
+uvmallocmega(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
+{
+  char *mem;
+  uint64 a, end, i;
+
+  if(newsz < oldsz)
+    return oldsz;
+
+  for(a = PGROUNDUP(oldsz); a < newsz; a = end){
+    end = MEGAROUNDDOWN(a) + MEGASIZE;
+    if(end > newsz)
+      end = newsz;
+    if(a % MEGASIZE == 0 && end - a == MEGASIZE && (mem = kallocmega()) != 0){
+      memset(mem, 0, MEGASIZE);
+      if(mappagesmega(pagetable, a, MEGASIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+        uvmunmap(pagetable, a, MEGASIZE/PGSIZE, 0);
+        for(i = 0; i < MEGASIZE; i += PGSIZE)
+          kfree(mem + i);
+        goto err;
+      }
+    } else if(uvmalloc(pagetable, a, end, xperm) == 0){
+      goto err;
+    }
+  }
+  return newsz;
+
+ err:
+  uvmdealloc(pagetable, a, PGROUNDUP(oldsz));
+  return 0;
+}
+
+// If va lies inside a megapage, but not at its start, remap the
+// megapage with 4096-byte pages, so that the part from va on can
+// be unmapped. The translations don't change.
+// Returns 0, or -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t pt;
+  pte_t *pte;
+  uint64 pa, flags;
+
+  if(va % MEGASIZE == 0 || va >= MAXVA)
+    return 0;
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_MEGA) == 0)
+    return 0;
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// Free the user pages of [va, va+len), which must be
+// page-aligned, leaving the range to be faulted in again by
+// vmfault(). Pages without PTE_U, like the stack guard page,
+// are left alone.
+// Returns 0, or -1 if out of memory.
+int
+uvmdiscard(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if(uvmsplit(pagetable, va) < 0 || uvmsplit(pagetable, va + len) < 0)
+    return -1;
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0 ||
+       (*pte & PTE_U) == 0)
+      continue;
+    if(*pte & PTE_MEGA){
+      uvmunmap(pagetable, a, MEGASIZE/PGSIZE, 1);
+      a += MEGASIZE - PGSIZE;
+    } else {
+      uvmunmap(pagetable, a, 1, 1);
+    }
+  }
+  return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -290,7 +644,8 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 // Given a parent process's page table, copy
 // its memory into a child's page table.
 // Copies both the page table and the
-// physical memory.
+// physical memory, except that read-only
+// pages are shared.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -306,11 +661,28 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
       continue;   // page table entry hasn't been allocated
     if((*pte & PTE_V) == 0)
       continue;   // physical page hasn't been allocated
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
+    pa = pteaddr(pte, i);
+    flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+    if((*pte & PTE_MEGA) && i % MEGASIZE == 0 && (mem = kallocmega()) != 0){
+      // copy a whole megapage into another, if there's one left.
+      memmove(mem, (char*)pa, MEGASIZE);
+      if(mappagesmega(new, i, MEGASIZE, (uint64)mem, flags) != 0){
+        for(uint64 j = 0; j < MEGASIZE; j += PGSIZE)
+          kfree(mem + j);
+        goto err;
+      }
+      i += MEGASIZE - PGSIZE;
+      continue;
+    }
+    if(flags & PTE_W){
+      if((mem = kalloc()) == 0)
+        goto err;
+      memmove(mem, (char*)pa, PGSIZE);
+    } else {
+      // read-only, e.g. program text: share it.
+      kdup((void*)pa);
+      mem = (char*)pa;
+    }
     if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
       kfree(mem);
       goto err;
@@ -334,6 +706,8 @@ uvmclear(pagetable_t pagetable, uint64 va)
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  utlbinval();
+  uvmflush(pagetable, va, 1);
 }
 
 // Copy from kernel to user.
@@ -342,25 +716,26 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
-  pte_t *pte;
+  uint64 n, va0, pa0, flags;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
   
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = utlblookup(pagetable, va0, &flags);
     if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+      if(vmfault(pagetable, va0, 0) == 0 ||
+         (pa0 = utlblookup(pagetable, va0, &flags)) == 0) {
         return -1;
       }
     }
 
-    pte = walk(pagetable, va0, 0);
     // forbid copyout over read-only user text pages.
-    if((*pte & PTE_W) == 0)
+    if((flags & PTE_W) == 0)
       return -1;
+    if((flags & PTE_D) == 0)
+      utlbdirty(pagetable, va0);
       
     n = PGSIZE - (dstva - va0);
     if(n > len)
@@ -380,13 +755,14 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, flags;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = utlblookup(pagetable, va0, &flags);
     if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+      if(vmfault(pagetable, va0, 1) == 0 ||
+         (pa0 = utlblookup(pagetable, va0, &flags)) == 0) {
         return -1;
       }
     }
@@ -409,14 +785,18 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, flags;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    pa0 = utlblookup(pagetable, va0, &flags);
+    if(pa0 == 0) {
+      if(vmfault(pagetable, va0, 1) == 0 ||
+         (pa0 = utlblookup(pagetable, va0, &flags)) == 0) {
+        return -1;
+      }
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -446,15 +826,19 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 }
 
 // allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
+// that was lazily allocated in sys_sbrk(), or read it in if it is
+// in an mmap()ed region. read is 1 for a load, 0 for a store.
 // returns 0 if va is invalid or already mapped, or if
 // out of physical memory, and physical address if successful.
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
   uint64 mem;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
+  struct vma *v;
 
+  if((v = vmalookup(p, va)) != 0)
+    return mmapfault(p, v, va, read);
   if (va >= p->sz)
     return 0;
   va = PGROUNDDOWN(va);
@@ -465,10 +849,33 @@ vmfault(pagetable_t pagetable, uint64 va, int read)
   if(mem == 0)
     return 0;
   memset((void *) mem, 0, PGSIZE);
-  if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
+  return uvmfaultmap(p, va, mem, PTE_W|PTE_U|PTE_R);
+}
+
+// Map page mem at va in p's page table with perm, for a page
+// fault. Another thread of the process may have faulted the page
+// in since the caller looked; then free mem and use that page.
+// Returns the physical address mapped at va, or 0.
+uint64
+uvmfaultmap(struct proc *p, uint64 va, uint64 mem, int perm)
+{
+  struct proc *l = p->leader;
+  pte_t *pte;
+  uint64 pa;
+
+  acquire(&l->tlock);
+  if((pte = walk(l->pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    pa = pteaddr(pte, va);
+    release(&l->tlock);
+    kfree((void *)mem);
+    return pa;
+  }
+  if(mappages(l->pagetable, va, PGSIZE, mem, perm) != 0){
+    release(&l->tlock);
     kfree((void *)mem);
     return 0;
   }
+  release(&l->tlock);
   return mem;
 }
 
@@ -1,2 +1,3 @@
 #define SBRK_EAGER 1
 #define SBRK_LAZY  2
+#define SBRK_HUGE  3  // eager, with megapages where possible
@@ -0,0 +1,178 @@
+// Compare malloc() with the Kernighan and Ritchie allocator
+// that it replaced, which is kept below as krmalloc()/krfree().
+//
+// usage: mallocbench [rounds]
+//
+// Each test runs the same sequence of allocations and frees
+// through both allocators and prints the ticks each took.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NSLOT 512
+
+typedef long Align;
+
+union header {
+  struct {
+    union header *ptr;
+    uint size;
+  } s;
+  Align x;
+};
+
+typedef union header Header;
+
+static Header base;
+static Header *freep;
+
+static void
+krfree(void *ap)
+{
+  Header *bp, *p;
+
+  bp = (Header*)ap - 1;
+  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
+    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
+      break;
+  if(bp + bp->s.size == p->s.ptr){
+    bp->s.size += p->s.ptr->s.size;
+    bp->s.ptr = p->s.ptr->s.ptr;
+  } else
+    bp->s.ptr = p->s.ptr;
+  if(p + p->s.size == bp){
+    p->s.size += bp->s.size;
+    p->s.ptr = bp->s.ptr;
+  } else
+    p->s.ptr = bp;
+  freep = p;
+}
+
+static Header*
+krmorecore(uint nu)
+{
+  char *p;
+  Header *hp;
+
+  if(nu < 4096)
+    nu = 4096;
+  p = sbrk(nu * sizeof(Header));
+  if(p == SBRK_ERROR)
+    return 0;
+  hp = (Header*)p;
+  hp->s.size = nu;
+  krfree((void*)(hp + 1));
+  return freep;
+}
+
+static void*
+krmalloc(uint nbytes)
+{
+  Header *p, *prevp;
+  uint nunits;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if((prevp = freep) == 0){
+    base.s.ptr = freep = prevp = &base;
+    base.s.size = 0;
+  }
+  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
+    if(p->s.size >= nunits){
+      if(p->s.size == nunits)
+        prevp->s.ptr = p->s.ptr;
+      else {
+        p->s.size -= nunits;
+        p += p->s.size;
+        p->s.size = nunits;
+      }
+      freep = prevp;
+      return (void*)(p + 1);
+    }
+    if(p == freep)
+      if((p = krmorecore(nunits)) == 0)
+        return 0;
+  }
+}
+
+struct alloc {
+  char *name;
+  void *(*malloc)(uint);
+  void (*free)(void*);
+};
+
+static void *slot[NSLOT];
+static uint seed;
+
+static uint
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+// Fill the slots, then repeatedly replace a random one with a
+// block of a random size below max; finally free them all.
+// Returns the ticks taken, or -1 if out of memory.
+static int
+churn(struct alloc *a, int rounds, uint max)
+{
+  int i, j, t0;
+
+  seed = 1;
+  t0 = uptime();
+  for(i = 0; i < NSLOT; i++)
+    if((slot[i] = a->malloc(1 + rnd() % max)) == 0)
+      return -1;
+  for(i = 0; i < rounds; i++){
+    j = rnd() % NSLOT;
+    a->free(slot[j]);
+    if((slot[j] = a->malloc(1 + rnd() % max)) == 0)
+      return -1;
+    *(char*)slot[j] = i;
+  }
+  for(i = 0; i < NSLOT; i++)
+    a->free(slot[i]);
+  return uptime() - t0;
+}
+
+// Allocate a list of n nodes and free it again, like sh
+// building and discarding a command tree.
+static int
+lifo(struct alloc *a, int rounds, uint size)
+{
+  int i, j, n, t0;
+
+  t0 = uptime();
+  for(i = 0; i < rounds / NSLOT; i++){
+    n = 1 + i % NSLOT;
+    for(j = 0; j < n; j++)
+      if((slot[j] = a->malloc(size)) == 0)
+        return -1;
+    for(j = n - 1; j >= 0; j--)
+      a->free(slot[j]);
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct alloc allocs[] = {
+    { "malloc", malloc, free },
+    { "k&r", krmalloc, krfree },
+  };
+  int rounds = 200000;
+  struct alloc *a;
+
+  if(argc > 1)
+    rounds = atoi(argv[1]);
+
+  printf("%d rounds, %d live blocks; ticks:\n", rounds, NSLOT);
+  for(a = allocs; a < &allocs[sizeof(allocs)/sizeof(allocs[0])]; a++){
+    printf("%s:\tsmall %d\tmixed %d\tlifo %d\n", a->name,
+           churn(a, rounds, 128), churn(a, rounds, 4096),
+           lifo(a, rounds * 16, 32));
+  }
+  exit(0);
+}
@@ -3,6 +3,8 @@
 #include "kernel/fcntl.h"
 #include "kernel/riscv.h"
 #include "kernel/vm.h"
+#include "kernel/ring.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 //
@@ -159,3 +161,215 @@ sbrklazy(int n) {
   return sys_sbrk(n, SBRK_LAZY);
 }
 
+char *
+sbrkhuge(int n) {
+  return sys_sbrk(n, SBRK_HUGE);
+}
+
+// Queue request e on ring r, to be carried out by ringenter().
+// Returns 0, or -1 if the ring is full.
+int
+ringput(struct ring *r, struct ringsqe *e)
+{
+  if(r->sqtail - r->sqhead >= NRING)
+    return -1;
+  r->sq[r->sqtail % NRING] = *e;
+  __sync_synchronize();  // the request before the index
+  r->sqtail++;
+  return 0;
+}
+
+// Take the oldest completion from ring r.
+// Returns 0, or -1 if there is none.
+int
+ringget(struct ring *r, struct ringcqe *c)
+{
+  if(r->cqhead == r->cqtail)
+    return -1;
+  __sync_synchronize();  // the index before the completion
+  *c = r->cq[r->cqhead % NRING];
+  r->cqhead++;
+  return 0;
+}
+
+
+// Spin locks, for threads that share memory (clone()).
+void
+lockinit(struct ulock *lk)
+{
+  lk->locked = 0;
+}
+
+void
+lockacquire(struct ulock *lk)
+{
+  // atomic swap; also a fence, so the critical section's
+  // loads and stores happen after the lock is held.
+  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+    ;
+}
+
+void
+lockrelease(struct ulock *lk)
+{
+  // a fence, then an atomic store of 0.
+  __sync_lock_release(&lk->locked);
+}
+
+int
+futexwait(int *addr, int val)
+{
+  return futex(addr, FUTEX_WAIT, val);
+}
+
+int
+futexwake(int *addr, int n)
+{
+  return futex(addr, FUTEX_WAKE, n);
+}
+
+// Locks that sleep in the kernel while another thread holds
+// them, instead of spinning. m->state is 0 if unlocked, 1 if
+// locked, and 2 if locked and a thread may be waiting, so that
+// unlocking only enters the kernel when there is a thread to
+// wake (Drepper, "Futexes Are Tricky").
+void
+mutexinit(struct umutex *m)
+{
+  m->state = 0;
+}
+
+void
+mutexlock(struct umutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  // mark it contended, and wait until it was unlocked.
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futexwait(&m->state, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutexunlock(struct umutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_lock_release(&m->state);
+    futexwake(&m->state, 1);
+  }
+}
+
+// Condition variables. c->seq changes on every signal, so a
+// waiter that saw the old value before unlocking m doesn't sleep
+// through a signal sent in between.
+void
+condinit(struct ucond *c)
+{
+  c->seq = 0;
+}
+
+// Unlock m, wait for a signal, and lock m again. As with any
+// condition variable, the caller must check its condition again.
+void
+condwait(struct ucond *c, struct umutex *m)
+{
+  int seq = c->seq;
+
+  mutexunlock(m);
+  futexwait(&c->seq, seq);
+  mutexlock(m);
+}
+
+void
+condsignal(struct ucond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futexwake(&c->seq, 1);
+}
+
+void
+condbroadcast(struct ucond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futexwake(&c->seq, 0x7fffffff);
+}
+
+#define TSTACK 4096  // bytes of stack for a threadcreate() thread
+
+struct tstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+// the stacks of running threads, to free in threadjoin().
+static struct {
+  struct ulock lock;
+  int tid[NTHREAD];
+  char *stack[NTHREAD];
+} threads;
+
+static void
+threadstart(void *a)
+{
+  struct tstart *t = a;
+
+  t->fn(t->arg);
+  exit(0);
+}
+
+// Start a thread running fn(arg) on a stack from malloc(); it
+// exits when fn returns.
+// Returns its pid, or -1.
+int
+threadcreate(void (*fn)(void*), void *arg)
+{
+  struct tstart *t;
+  char *stack;
+  int i, tid;
+
+  if((stack = malloc(TSTACK)) == 0)
+    return -1;
+  // the start-up arguments go at the top of the stack.
+  t = (struct tstart*)(stack + TSTACK) - 1;
+  t->fn = fn;
+  t->arg = arg;
+  lockacquire(&threads.lock);
+  for(i = 0; i < NTHREAD; i++)
+    if(threads.stack[i] == 0)
+      break;
+  if(i == NTHREAD || (tid = clone(threadstart, t, t)) < 0){
+    lockrelease(&threads.lock);
+    free(stack);
+    return -1;
+  }
+  threads.tid[i] = tid;
+  threads.stack[i] = stack;
+  lockrelease(&threads.lock);
+  return tid;
+}
+
+// Wait for a thread from threadcreate() to exit, as join()
+// does, and free its stack.
+int
+threadjoin(int tid, int *status)
+{
+  int i;
+
+  if((tid = join(tid, status)) < 0)
+    return -1;
+  lockacquire(&threads.lock);
+  for(i = 0; i < NTHREAD; i++){
+    if(threads.stack[i] && threads.tid[i] == tid){
+      free(threads.stack[i]);
+      threads.stack[i] = 0;
+      break;
+    }
+  }
+  lockrelease(&threads.lock);
+  return tid;
+}
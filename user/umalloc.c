@@ -1,10 +1,29 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Every block starts with a Header that gives its size in
+// Header-sized units, the Header included. Blocks of at most NBIN
+// units are small: a freed one is pushed on bin[size], and
+// malloc() pops one from there or carves a new one off the
+// current chunk of sbrk()ed memory, so both take constant time.
+// Small blocks are never merged. Larger blocks come from the
+// first-fit free list of Kernighan and Ritchie, The C Programming
+// Language, 2nd ed., Section 8.7, which grows with sbrk().
+//
+// Freeing a large block hands memory back to the kernel once
+// there is at least RELEASE bytes of it: a free block at the top
+// of the heap is cut off with sbrk(-n), and the whole pages
+// inside a block elsewhere are dropped with madvise(), to be
+// faulted in again as zeros if they are reused.
+//
+// Threads share the heap, so malloc() and free() hold a spin
+// lock.
 
 typedef long Align;
 
@@ -18,15 +37,25 @@ union header {
 
 typedef union header Header;
 
+#define NBIN  64    // small blocks have at most NBIN units
+#define CHUNK 4096  // units to sbrk() at a time for small blocks
+#define RELEASE (64*1024)  // free bytes worth giving back
+
+static Header *bin[NBIN+1];  // free small blocks, by size
+static Header *chunk;        // unused part of the current chunk
+static uint nchunk;          // its size in units
+
 static Header base;
 static Header *freep;
+static struct ulock lock;
 
-void
-free(void *ap)
+// Return a large block to the address-ordered free list,
+// merging it with its neighbours.
+static void
+lfree(Header *bp)
 {
-  Header *bp, *p;
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -43,6 +72,48 @@ free(void *ap)
   freep = p;
 }
 
+// If free block b is big and ends at the break, shrink the heap
+// to just past b's header. Returns 1 if it did.
+static int
+trim(Header *b)
+{
+  char *top, *cut;
+
+  if(b->s.size < RELEASE / sizeof(Header))
+    return 0;
+  top = sbrk(0);
+  if((char*)(b + b->s.size) != top)
+    return 0;
+  cut = (char*)PGROUNDUP((uint64)(b + 1));
+  if(cut >= top || sbrk(-(top - cut)) == SBRK_ERROR)
+    return 0;
+  b->s.size = (Header*)cut - b;
+  return 1;
+}
+
+static void
+bfree(void *ap)
+{
+  Header *bp;
+  uint64 lo, hi;
+
+  bp = (Header*)ap - 1;
+  if(bp->s.size <= NBIN){
+    bp->s.ptr = bin[bp->s.size];
+    bin[bp->s.size] = bp;
+    return;
+  }
+
+  lo = PGROUNDUP((uint64)(bp + 1));
+  hi = PGROUNDDOWN((uint64)(bp + bp->s.size));
+  lfree(bp);
+  // the freed memory is now part of freep or of the block after it.
+  if(trim(freep) || trim(freep->s.ptr))
+    return;
+  if(hi >= lo + RELEASE)
+    madvise((void*)lo, hi - lo, MADV_DONTNEED);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,17 +127,16 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  lfree(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+// Allocate a large block of nunits from the free list.
+static void*
+lmalloc(uint nunits)
 {
   Header *p, *prevp;
-  uint nunits;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -88,3 +158,56 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+static void*
+balloc(uint nbytes)
+{
+  Header *p;
+  uint nunits;
+  char *cp;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if(nunits > NBIN)
+    return lmalloc(nunits);
+
+  if((p = bin[nunits]) != 0){
+    bin[nunits] = p->s.ptr;
+    return (void*)(p + 1);
+  }
+  if(nchunk < nunits){
+    // keep what is left of the chunk as a free block.
+    if(nchunk > 0){
+      chunk->s.size = nchunk;
+      bfree((void*)(chunk + 1));
+    }
+    nchunk = 0;
+    if((cp = sbrk(CHUNK * sizeof(Header))) == SBRK_ERROR)
+      return lmalloc(nunits);  // the free list may have room
+    chunk = (Header*)cp;
+    nchunk = CHUNK;
+  }
+  p = chunk;
+  p->s.size = nunits;
+  chunk += nunits;
+  nchunk -= nunits;
+  return (void*)(p + 1);
+}
+
+void
+free(void *ap)
+{
+  lockacquire(&lock);
+  bfree(ap);
+  lockrelease(&lock);
+}
+
+void*
+malloc(uint nbytes)
+{
+  void *p;
+
+  lockacquire(&lock);
+  p = balloc(nbytes);
+  lockrelease(&lock);
+  return p;
+}
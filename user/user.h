@@ -1,6 +1,11 @@
 #define SBRK_ERROR ((char *)-1)
+#define MAP_FAILED ((void *)-1)
 
 struct stat;
+struct iovec;
+struct ring;
+struct ringsqe;
+struct ringcqe;
 
 // MLFQ Scheduler structures
 struct procinfo {
@@ -20,6 +25,19 @@ struct mlfq_stats {
   uint64 level_schedules[4];
 };
 
+// locks and condition variables for threads; see ulib.c.
+struct ulock {
+  uint locked;
+};
+
+struct umutex {
+  int state;
+};
+
+struct ucond {
+  int seq;
+};
+
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
@@ -45,6 +63,22 @@ int uptime(void);
 int getprocinfo(struct procinfo*);
 int boostproc(int);  // Week 3: Manual priority boost
 int getschedulerstats(struct mlfq_stats*);  // Week 3: Get scheduler statistics
+int splice(int, int, int);
+void *mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
+int madvise(void*, uint64, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+struct ring* ringsetup(void);
+int ringenter(int);
+int aioread(int, void*, int, int);
+int aiowrite(int, const void*, int, int);
+int aiowait(int, int, int*);
+int clone(void (*)(void*), void*, void*);
+int join(int, int*);
+int futex(int*, int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -60,6 +94,23 @@ int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 char* sbrk(int);
 char* sbrklazy(int);
+char* sbrkhuge(int);
+int ringput(struct ring*, struct ringsqe*);
+int ringget(struct ring*, struct ringcqe*);
+void lockinit(struct ulock*);
+void lockacquire(struct ulock*);
+void lockrelease(struct ulock*);
+int futexwait(int*, int);
+int futexwake(int*, int);
+void mutexinit(struct umutex*);
+void mutexlock(struct umutex*);
+void mutexunlock(struct umutex*);
+void condinit(struct ucond*);
+void condwait(struct ucond*, struct umutex*);
+void condsignal(struct ucond*);
+void condbroadcast(struct ucond*);
+int threadcreate(void (*)(void*), void*);
+int threadjoin(int, int*);
 
 // printf.c
 void fprintf(int, const char*, ...) __attribute__ ((format (printf, 2, 3)));
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/ring.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -21,6 +22,8 @@
 
 char buf[BUFSZ];
 
+int countfree(void);
+
 //
 // Section with tests that run fairly quickly.  Use -q if you want to
 // run just those.  Without -q usertests also runs the ones that take a
@@ -241,6 +244,46 @@ copyinstr3(char *s)
   }
 }
 
+// a path on a page of the program that hasn't been read in yet,
+// alone on it so that nothing else has touched it, and one in an
+// mmap()ed page: copyinstr() must fault them in.
+static const char coldpath[PGSIZE] __attribute__((aligned(PGSIZE))) = "README";
+
+void
+copyinstr4(char *s)
+{
+  int fd, pfd;
+  char *p;
+
+  fd = open(coldpath, O_RDONLY);
+  if(fd < 0){
+    printf("%s: open of path on untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  unlink("cipath");
+  pfd = open("cipath", O_CREATE|O_RDWR);
+  if(pfd < 0 || write(pfd, "README", 7) != 7){
+    printf("%s: create cipath failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 4096, PROT_READ, MAP_PRIVATE, pfd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  fd = open(p, O_RDONLY);
+  if(fd < 0){
+    printf("%s: open of path in mapped page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  munmap(p, 4096);
+  close(pfd);
+  unlink("cipath");
+}
+
 // See if the kernel refuses to read/write user memory that the
 // application doesn't have anymore, because it returned it.
 void
@@ -733,6 +776,77 @@ exectest(char *s)
 
 }
 
+// a program can't be written while a process runs it,
+// not even through a descriptor opened before the exec.
+void
+exectxtbsy(char *s)
+{
+  int fd, pid, xstatus, in[2], out[2];
+  char *catargv[] = { "cat", 0 };
+  char c, buf[1];
+
+  if((fd = open("cat", O_RDWR)) < 0){
+    printf("%s: open cat failed\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 1, 0) != 1){
+    printf("%s: pread failed\n", s);
+    exit(1);
+  }
+  if(pipe(in) < 0 || pipe(out) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(in[0]);
+    close(1);
+    dup(out[1]);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(fd);
+    exec("cat", catargv);
+    exit(1);
+  }
+  close(in[0]);
+  close(out[1]);
+
+  // once cat echoes a byte, it is running.
+  if(write(in[1], "x", 1) != 1 || read(out[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: cat didn't run\n", s);
+    exit(1);
+  }
+  if(open("cat", O_WRONLY) >= 0){
+    printf("%s: opened running cat for writing\n", s);
+    exit(1);
+  }
+  // writes back the byte it read, in case it isn't refused.
+  if(pwrite(fd, buf, 1, 0) >= 0){
+    printf("%s: wrote to running cat\n", s);
+    exit(1);
+  }
+
+  close(in[1]);
+  wait(&xstatus);
+  close(out[0]);
+  if(xstatus != 0){
+    printf("%s: cat failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, buf, 1, 0) != 1){
+    printf("%s: write after exit failed\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
 // simple fork and pipe read/write
 
 void
@@ -789,152 +903,605 @@ pipe1(char *s)
 }
 
 
-// test if child is killed (status = -1)
+// large pipe transfers that wrap around the pipe's buffer and
+// cross page boundaries in user memory.
 void
-killstatus(char *s)
+pipebulk(char *s)
 {
-  int xst;
+  int fds[2], pid, xstatus;
+  int i, n, total;
+  enum { TOTAL=64*1024, WSZ=5000, RSZ=3001 };
   
-  for(int i = 0; i < 100; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("%s: fork failed\n", s);
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    char *p = sbrk(TOTAL + 1);
+    if(p == SBRK_ERROR){
+      printf("%s: sbrk failed\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      while(1) {
-        getpid();
+    p++;   // misaligned source
+    for(i = 0; i < TOTAL; i++)
+      p[i] = i % 251;
+    for(i = 0; i < TOTAL; i += n){
+      n = TOTAL - i < WSZ ? TOTAL - i : WSZ;
+      if(write(fds[1], p + i, n) != n){
+        printf("%s: pipebulk write failed\n", s);
+        exit(1);
       }
-      exit(0);
     }
-    pause(1);
-    kill(pid1);
-    wait(&xst);
-    if(xst != -1) {
-       printf("%s: status should be -1\n", s);
-       exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf + 1, RSZ)) > 0){
+    for(i = 0; i < n; i++){
+      if((buf[1 + i] & 0xff) != (total + i) % 251){
+        printf("%s: pipebulk wrong data at %d\n", s, total + i);
+        exit(1);
+      }
     }
+    total += n;
   }
-  exit(0);
+  close(fds[0]);
+  if(total != TOTAL){
+    printf("%s: pipebulk total %d\n", s, total);
+    exit(1);
+  }
+  wait(&xstatus);
+  exit(xstatus);
 }
 
-// meant to be run w/ at most two CPUs
+
+// splice() a file into a pipe in one process and out of the
+// pipe into another file in a second.
 void
-preempt(char *s)
+splicetest(char *s)
 {
-  int pid1, pid2, pid3;
-  int pfds[2];
+  int fds[2], fd, in, out, pid, xstatus;
+  int i, n, total;
+  enum { SZ=10000 };
 
-  pid1 = fork();
-  if(pid1 < 0) {
-    printf("%s: fork failed", s);
+  fd = open("splicein", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create splicein failed\n", s);
     exit(1);
   }
-  if(pid1 == 0)
-    for(;;)
-      ;
+  for(i = 0; i < SZ; i++)
+    buf[i] = i % 253;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write splicein failed\n", s);
+    exit(1);
+  }
+  close(fd);
 
-  pid2 = fork();
-  if(pid2 < 0) {
-    printf("%s: fork failed\n", s);
+  // file to file is not supported.
+  in = open("splicein", O_RDONLY);
+  out = open("spliceout", O_CREATE|O_RDWR);
+  if(in < 0 || out < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(splice(in, out, 10) != -1){
+    printf("%s: file to file splice succeeded\n", s);
     exit(1);
   }
-  if(pid2 == 0)
-    for(;;)
-      ;
 
-  pipe(pfds);
-  pid3 = fork();
-  if(pid3 < 0) {
-     printf("%s: fork failed\n", s);
-     exit(1);
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
   }
-  if(pid3 == 0){
-    close(pfds[0]);
-    if(write(pfds[1], "x", 1) != 1)
-      printf("%s: preempt write error", s);
-    close(pfds[1]);
-    for(;;)
-      ;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    // asks for more than the file holds.
+    n = splice(in, fds[1], 2*SZ);
+    exit(n == SZ ? 0 : 1);
+  }
+  close(fds[1]);
+  close(in);
+  total = 0;
+  while((n = splice(fds[0], out, 3000)) > 0)
+    total += n;
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0 || n < 0 || total != SZ){
+    printf("%s: splice moved %d, status %d\n", s, total, xstatus);
+    exit(1);
   }
+  close(out);
 
-  close(pfds[1]);
-  if(read(pfds[0], buf, sizeof(buf)) != 1){
-    printf("%s: preempt read error", s);
-    return;
+  fd = open("spliceout", O_RDONLY);
+  memset(buf, 0, SZ);
+  if(read(fd, buf, SZ+1) != SZ){
+    printf("%s: spliceout has the wrong size\n", s);
+    exit(1);
   }
-  close(pfds[0]);
-  printf("kill... ");
-  kill(pid1);
-  kill(pid2);
-  kill(pid3);
-  printf("wait... ");
-  wait(0);
-  wait(0);
-  wait(0);
+  for(i = 0; i < SZ; i++){
+    if((buf[i] & 0xff) != i % 253){
+      printf("%s: spliceout wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("splicein");
+  unlink("spliceout");
 }
 
-// try to find any races between exit and wait
+
+// map a file, privately and shared, and check what is read in,
+// what is written back, and what a forked child sees.
 void
-exitwait(char *s)
+mmaptest(char *s)
 {
-  int i, pid;
+  int fd, fds[2], i, pid, xstatus;
+  char *p, *q;
+  enum { SZ=2*4096+1000 };
 
-  for(i = 0; i < 100; i++){
-    pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+
+  // private, read-only: file contents, then zeros past the end.
+  p = mmap(0, 3*4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*4096; i++){
+    if(p[i] != (i < SZ ? 'a' + i % 26 : 0)){
+      printf("%s: mmap private wrong byte at %d\n", s, i);
       exit(1);
     }
-    if(pid){
-      int xstate;
-      if(wait(&xstate) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-      if(i != xstate) {
-        printf("%s: wait wrong exit status\n", s);
-        exit(1);
-      }
-    } else {
-      exit(i);
-    }
   }
-}
+  // write() from the mapping, through a pipe.
+  if(pipe(fds) != 0 || write(fds[1], p + 4090, 100) != 100 ||
+     read(fds[0], buf, 100) != 100 || memcmp(buf, p + 4090, 100) != 0){
+    printf("%s: write from mapping failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  // unmapping the middle page leaves the others.
+  if(munmap(p + 4096, 4096) != 0 || p[0] != 'a' || p[2*4096] != 'a' + (2*4096) % 26){
+    printf("%s: munmap middle failed\n", s);
+    exit(1);
+  }
+  if(munmap(p, 4096) != 0 || munmap(p + 2*4096, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
 
-// try to find races in the reparenting
-// code that handles a parent exiting
-// when it still has live children.
-void
-reparent(char *s)
-{
-  int master_pid = getpid();
-  for(int i = 0; i < 200; i++){
-    int pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed\n", s);
+  // shared, writable: a forked child shares the parent's pages,
+  // and its writes reach the file.
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'X')
       exit(1);
-    }
-    if(pid){
-      if(wait(0) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-    } else {
-      int pid2 = fork();
-      if(pid2 < 0){
-        kill(master_pid);
-        exit(1);
-      }
-      exit(0);
-    }
+    p[1] = 'W';
+    p[4096] = 'Y';
+    exit(0);   // exit writes back the child's dirty page.
   }
-  exit(0);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong mapping\n", s);
+    exit(1);
+  }
+  if(p[1] != 'W'){
+    printf("%s: child's write to shared page not seen\n", s);
+    exit(1);
+  }
+  // read() into the mapping.
+  q = "hello";
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, p + SZ - 5, 5) != 5 || memcmp(p + SZ - 5, "abcde", 5) != 0){
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  memmove(p + 2*4096, q, 5);
+  p[SZ + 10] = 'Z';   // past the end of the file; not written back.
+  if(munmap(p, SZ) != 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, sizeof(buf)) != SZ){
+    printf("%s: mmapfile changed size\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'X' || buf[1] != 'W' || buf[4096] != 'Y' || memcmp(buf + 2*4096, q, 5) != 0){
+    printf("%s: shared writes not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read-only file can't be mapped shared and writable.
+  fd = open("mmapfile", O_RDONLY);
+  if(mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+    printf("%s: mmap of read-only file succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
 }
 
-// what if two children exit() at the same time?
+
+// two processes that map a file MAP_SHARED on their own see each
+// other's stores at once, and so do read() and write().
 void
-twochildren(char *s)
+mmapcoherent(char *s)
+{
+  int fd, pid, xstatus, tochild[2], toparent[2];
+  char *p, c;
+
+  fd = open("mmapcoh", O_CREATE|O_RDWR);
+  memset(buf, 'a', 4096);
+  if(fd < 0 || write(fd, buf, 4096) != 4096){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(tochild) != 0 || pipe(toparent) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    fd = open("mmapcoh", O_RDWR);
+    p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED)
+      exit(1);
+    p[10] = 'x';
+    write(toparent[1], "1", 1);
+    // the parent stores to its mapping, and write()s the file.
+    if(read(tochild[0], &c, 1) != 1 || p[11] != 'y' || p[12] != 'z')
+      exit(2);
+    munmap(p, 4096);
+    exit(0);
+  }
+
+  fd = open("mmapcoh", O_RDWR);
+  if(read(toparent[0], &c, 1) != 1){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(p[10] != 'x'){
+    printf("%s: child's store not seen\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 16, 0) != 16 || buf[10] != 'x'){
+    printf("%s: read() doesn't see child's store\n", s);
+    exit(1);
+  }
+  p[11] = 'y';
+  if(pwrite(fd, "z", 1, 12) != 1 || p[12] != 'z'){
+    printf("%s: write() not seen in mapping\n", s);
+    exit(1);
+  }
+  write(tochild[1], "1", 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child didn't see parent's changes\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+  close(tochild[0]);
+  close(tochild[1]);
+  close(toparent[0]);
+  close(toparent[1]);
+  unlink("mmapcoh");
+}
+
+// a shared page that only the kernel has written to, by read()
+// from a pipe, is written back too.
+void
+mmapread(char *s)
+{
+  int fd, fds[2], i;
+  char *p;
+
+  fd = open("mmapread", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', 4096);
+  if(write(fd, buf, 4096) != 4096){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  // the page isn't touched before read() faults it in.
+  if(pipe(fds) != 0 || write(fds[1], "hello", 5) != 5 ||
+     read(fds[0], p + 100, 5) != 5){
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(munmap(p, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapread", O_RDONLY);
+  if(read(fd, buf, 4096) != 4096 || memcmp(buf + 100, "hello", 5) != 0){
+    printf("%s: read() into shared page not written back\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 100; i++){
+    if(buf[i] != 'a'){
+      printf("%s: wrong byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmapread");
+}
+
+// read-only file pages are shared between processes; check that
+// a page changed by write() isn't served stale afterwards.
+void
+mmapstale(char *s)
+{
+  int fd, pid, xstatus;
+  char *p;
+
+  fd = open("mmapstale", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "aaaa", 4) != 4){
+    printf("%s: create mmapstale failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || p[0] != 'a'){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  // a child sees the same page, and another mapping of it
+  // gets the cached copy.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    char *q = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(q == MAP_FAILED || p[3] != 'a' || q[3] != 'a' || q[4] != 0)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong mapping\n", s);
+    exit(1);
+  }
+  if(munmap(p, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // overwrite and extend the file, then map it again.
+  if(write(fd, "bbbb", 4) != 4){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || p[0] != 'a' || p[4] != 'b' || p[8] != 0){
+    printf("%s: stale page after write\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+
+  // a new file that reuses the inode must not see old pages.
+  unlink("mmapstale");
+  fd = open("mmapstale", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "c", 1) != 1){
+    printf("%s: recreate mmapstale failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || p[0] != 'c' || p[1] != 0){
+    printf("%s: stale page in new file\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+  close(fd);
+  unlink("mmapstale");
+}
+
+// test if child is killed (status = -1)
+void
+killstatus(char *s)
+{
+  int xst;
+  
+  for(int i = 0; i < 100; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0){
+      while(1) {
+        getpid();
+      }
+      exit(0);
+    }
+    pause(1);
+    kill(pid1);
+    wait(&xst);
+    if(xst != -1) {
+       printf("%s: status should be -1\n", s);
+       exit(1);
+    }
+  }
+  exit(0);
+}
+
+// meant to be run w/ at most two CPUs
+void
+preempt(char *s)
+{
+  int pid1, pid2, pid3;
+  int pfds[2];
+
+  pid1 = fork();
+  if(pid1 < 0) {
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid1 == 0)
+    for(;;)
+      ;
+
+  pid2 = fork();
+  if(pid2 < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid2 == 0)
+    for(;;)
+      ;
+
+  pipe(pfds);
+  pid3 = fork();
+  if(pid3 < 0) {
+     printf("%s: fork failed\n", s);
+     exit(1);
+  }
+  if(pid3 == 0){
+    close(pfds[0]);
+    if(write(pfds[1], "x", 1) != 1)
+      printf("%s: preempt write error", s);
+    close(pfds[1]);
+    for(;;)
+      ;
+  }
+
+  close(pfds[1]);
+  if(read(pfds[0], buf, sizeof(buf)) != 1){
+    printf("%s: preempt read error", s);
+    return;
+  }
+  close(pfds[0]);
+  printf("kill... ");
+  kill(pid1);
+  kill(pid2);
+  kill(pid3);
+  printf("wait... ");
+  wait(0);
+  wait(0);
+  wait(0);
+}
+
+// try to find any races between exit and wait
+void
+exitwait(char *s)
+{
+  int i, pid;
+
+  for(i = 0; i < 100; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      int xstate;
+      if(wait(&xstate) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+      if(i != xstate) {
+        printf("%s: wait wrong exit status\n", s);
+        exit(1);
+      }
+    } else {
+      exit(i);
+    }
+  }
+}
+
+// try to find races in the reparenting
+// code that handles a parent exiting
+// when it still has live children.
+void
+reparent(char *s)
+{
+  int master_pid = getpid();
+  for(int i = 0; i < 200; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      if(wait(0) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+    } else {
+      int pid2 = fork();
+      if(pid2 < 0){
+        kill(master_pid);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  exit(0);
+}
+
+// what if two children exit() at the same time?
+void
+twochildren(char *s)
 {
   for(int i = 0; i < 1000; i++){
     int pid1 = fork();
@@ -1018,138 +1585,696 @@ forkforkfork(char *s)
       }
     }
 
-    exit(0);
+    exit(0);
+  }
+
+  pause(20); // two seconds
+  close(open("stopforking", O_CREATE|O_RDWR));
+  wait(0);
+  pause(10); // one second
+}
+
+// regression test. does reparent() violate the parent-then-child
+// locking order when giving away a child to init, so that exit()
+// deadlocks against init's wait()? also used to trigger a "panic:
+// release" due to exit() releasing a different p->parent->lock than
+// it acquired.
+void
+reparent2(char *s)
+{
+  for(int i = 0; i < 800; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid1 == 0){
+      fork();
+      fork();
+      exit(0);
+    }
+    wait(0);
+  }
+
+  exit(0);
+}
+
+// allocate all mem, free it, and allocate again
+void
+mem(char *s)
+{
+  void *m1, *m2;
+  int pid;
+
+  if((pid = fork()) == 0){
+    m1 = 0;
+    while((m2 = malloc(10001)) != 0){
+      *(char**)m2 = m1;
+      m1 = m2;
+    }
+    while(m1){
+      m2 = *(char**)m1;
+      free(m1);
+      m1 = m2;
+    }
+    m1 = malloc(1024*20);
+    if(m1 == 0){
+      printf("%s: couldn't allocate mem?!!\n", s);
+      exit(1);
+    }
+    free(m1);
+    exit(0);
+  } else {
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus == -1){
+      // probably page fault, so might be lazy lab,
+      // so OK.
+      exit(0);
+    }
+    exit(xstatus);
+  }
+}
+
+// More file system tests
+
+// two processes write to the same file descriptor
+// is the offset shared? does inode locking work?
+void
+sharedfd(char *s)
+{
+  int fd, pid, i, n, nc, np;
+  enum { N = 1000, SZ=10};
+  char buf[SZ];
+
+  unlink("sharedfd");
+  fd = open("sharedfd", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot open sharedfd for writing", s);
+    exit(1);
+  }
+  pid = fork();
+  memset(buf, pid==0?'c':'p', sizeof(buf));
+  for(i = 0; i < N; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write sharedfd failed\n", s);
+      exit(1);
+    }
+  }
+  if(pid == 0) {
+    exit(0);
+  } else {
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  
+  close(fd);
+  fd = open("sharedfd", 0);
+  if(fd < 0){
+    printf("%s: cannot open sharedfd for reading\n", s);
+    exit(1);
+  }
+  nc = np = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    for(i = 0; i < sizeof(buf); i++){
+      if(buf[i] == 'c')
+        nc++;
+      if(buf[i] == 'p')
+        np++;
+    }
+  }
+  close(fd);
+  unlink("sharedfd");
+  if(nc == N*SZ && np == N*SZ){
+    exit(0);
+  } else {
+    printf("%s: nc/np test fails\n", s);
+    exit(1);
+  }
+}
+
+// four processes write different files at the same
+// time, to test block allocation.
+// more open files, across processes, than the old fixed-size
+// file table held.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 12 };
+  int go[2], done[2], fds[2], i, n, pid;
+  char c;
+
+  if(pipe(go) < 0 || pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(go[1]);
+      close(done[0]);
+      // fill the rest of the descriptor table with pipe ends.
+      for(n = 0; pipe(fds) == 0; n += 2)
+        ;
+      if(n < 8){
+        printf("%s: only %d pipe descriptors\n", s, n);
+        exit(1);
+      }
+      write(done[1], "x", 1);
+      read(go[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(done[1]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(done[0], &c, 1) != 1){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  close(go[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&n);
+    if(n != 0)
+      exit(1);
+  }
+  close(go[0]);
+  close(done[0]);
+}
+
+// pread() and pwrite() at explicit offsets, and readv() and
+// writev() with several buffers, on a file and a pipe.
+void
+iovtest(char *s)
+{
+  char a[10], b[600], c[3000], buf[4000];
+  struct iovec iov[3];
+  int fd, fds[2], i;
+
+  memset(a, 'a', sizeof(a));
+  memset(b, 'b', sizeof(b));
+  memset(c, 'c', sizeof(c));
+  iov[0].iov_base = a;
+  iov[0].iov_len = sizeof(a);
+  iov[1].iov_base = b;
+  iov[1].iov_len = sizeof(b);
+  iov[2].iov_base = c;
+  iov[2].iov_len = sizeof(c);
+
+  unlink("iovfile");
+  fd = open("iovfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(writev(fd, iov, 3) != sizeof(a)+sizeof(b)+sizeof(c)){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  // overwrite the start of b without moving the offset.
+  if(pwrite(fd, "xyz", 3, sizeof(a)) != 3 || write(fd, "!", 1) != 1){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 4, sizeof(a) - 1) != 4 || memcmp(buf, "axyz", 4) != 0){
+    printf("%s: pread got wrong data\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, sizeof(buf), 0) != sizeof(a)+sizeof(b)+sizeof(c)+1 ||
+     buf[sizeof(a)+sizeof(b)+sizeof(c)] != '!'){
+    printf("%s: pread of whole file wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  memset(c, 0, sizeof(c));
+  if(readv(fd, iov, 3) != sizeof(a)+sizeof(b)+sizeof(c)){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(c); i++){
+    if(c[i] != 'c' || (i < sizeof(a) && a[i] != 'a') ||
+       (i >= 3 && i < sizeof(b) && b[i] != 'b') || memcmp(b, "xyz", 3) != 0){
+      printf("%s: readv got wrong data\n", s);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, 10) != 1 || buf[0] != '!'){
+    printf("%s: readv didn't advance the offset\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("iovfile");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  iov[2].iov_len = 100;
+  if(writev(fds[1], iov, 3) != sizeof(a)+sizeof(b)+100){
+    printf("%s: writev to pipe failed\n", s);
+    exit(1);
+  }
+  if(pread(fds[0], buf, 1, 0) != -1){
+    printf("%s: pread on a pipe worked\n", s);
+    exit(1);
+  }
+  if(read(fds[0], buf, sizeof(buf)) != sizeof(a)+sizeof(b)+100){
+    printf("%s: read from pipe failed\n", s);
+    exit(1);
+  }
+
+  // readv() from a pipe fills only the first buffer with room,
+  // rather than wait for more data.
+  if(write(fds[1], "hello", 5) != 5){
+    printf("%s: write to pipe failed\n", s);
+    exit(1);
+  }
+  memset(b, 0, sizeof(b));
+  memset(c, 0, sizeof(c));
+  iov[0].iov_len = 0;
+  iov[1].iov_len = 3;
+  if(readv(fds[0], iov, 3) != 3 || memcmp(b, "hel", 3) != 0 || c[0] != 0){
+    printf("%s: readv from pipe went past the first buffer\n", s);
+    exit(1);
+  }
+  if(readv(fds[0], iov, 3) != 2 || memcmp(b, "lo", 2) != 0 || c[0] != 0){
+    printf("%s: second readv from pipe wrong\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// batched system calls through the ringsetup() page.
+void
+ringtest(char *s)
+{
+  struct ring *r;
+  struct ringsqe e;
+  struct ringcqe c;
+  struct stat st;
+  char buf[8];
+  int fd, i, pid, xstatus;
+
+  r = ringsetup();
+  if(r == (struct ring*)-1 || ringsetup() != r){
+    printf("%s: ringsetup failed\n", s);
+    exit(1);
+  }
+
+  memset(&e, 0, sizeof(e));
+  e.op = RING_OPEN;
+  e.addr = (uint64)"ringfile";
+  e.n = O_CREATE|O_RDWR;
+  if(ringput(r, &e) != 0 || ringenter(1) != 1 || ringget(r, &c) != 0 || c.res < 0){
+    printf("%s: ring open failed\n", s);
+    exit(1);
+  }
+  fd = c.res;
+
+  // a full ring of writes in one trap.
+  for(i = 0; i < NRING; i++){
+    e.op = RING_WRITE;
+    e.fd = fd;
+    e.addr = (uint64)"abcdefgh";
+    e.n = 8;
+    e.off = -1;
+    e.tag = i;
+    if(ringput(r, &e) != 0){
+      printf("%s: ringput failed\n", s);
+      exit(1);
+    }
+  }
+  if(ringput(r, &e) != -1){
+    printf("%s: ringput into a full ring worked\n", s);
+    exit(1);
+  }
+  if(ringenter(2*NRING) != NRING){
+    printf("%s: ringenter didn't do all the writes\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NRING; i++){
+    if(ringget(r, &c) != 0 || c.tag != i || c.res != 8){
+      printf("%s: bad write completion %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(ringget(r, &c) != -1){
+    printf("%s: extra completion\n", s);
+    exit(1);
+  }
+
+  e.op = RING_FSTAT;
+  e.addr = (uint64)&st;
+  ringput(r, &e);
+  e.op = RING_READ;
+  e.addr = (uint64)buf;
+  e.n = 4;
+  e.off = 8*NRING - 4;
+  ringput(r, &e);
+  e.op = RING_CLOSE;
+  ringput(r, &e);
+  if(ringenter(3) != 3){
+    printf("%s: ringenter failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++){
+    if(ringget(r, &c) != 0 || c.res != (i == 1 ? 4 : 0)){
+      printf("%s: bad completion %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(st.size != 8*NRING || memcmp(buf, "efgh", 4) != 0){
+    printf("%s: ring fstat or read wrong\n", s);
+    exit(1);
+  }
+  if(close(fd) != -1){
+    printf("%s: ring close didn't close\n", s);
+    exit(1);
+  }
+  unlink("ringfile");
+
+  // the child gets its own copy.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    e.op = RING_NOP;
+    e.tag = 99;
+    if(ringput(r, &e) != 0 || ringenter(1) != 1 || ringget(r, &c) != 0 || c.tag != 99)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: ring in child failed\n", s);
+    exit(1);
+  }
+  if(ringget(r, &c) != -1){
+    printf("%s: child's completion in parent\n", s);
+    exit(1);
+  }
+}
+
+// asynchronous reads and writes, collected in any order.
+void
+aiotest(char *s)
+{
+  enum { N = 4, SZ = 1024, BIG = 3*PGSIZE+100 };
+  static char buf[N][SZ], big[BIG];
+  int fd, i, id[N], got, res, r, pid, xstatus;
+
+  unlink("aiofile");
+  fd = open("aiofile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf[i], 'a' + i, SZ);
+    if((id[i] = aiowrite(fd, buf[i], SZ, i*SZ)) < 0){
+      printf("%s: aiowrite failed\n", s);
+      exit(1);
+    }
+    // the request has its own copy.
+    memset(buf[i], 0, SZ);
+  }
+  for(got = 0; got < N; got++){
+    if((r = aiowait(-1, 1, &res)) < 0 || res != SZ){
+      printf("%s: aiowait for write failed\n", s);
+      exit(1);
+    }
+  }
+  if(aiowait(-1, 1, &res) != -1 || aiowait(id[0], 0, &res) != -1){
+    printf("%s: aiowait found a collected request\n", s);
+    exit(1);
+  }
+
+  // requests keep the file open.
+  for(i = 0; i < N; i++)
+    if((id[i] = aioread(fd, buf[i], SZ, (N-1-i)*SZ)) < 0){
+      printf("%s: aioread failed\n", s);
+      exit(1);
+    }
+  close(fd);
+  for(i = N-1; i >= 0; i--){
+    // poll until it is done.
+    while((r = aiowait(id[i], 0, &res)) == -1)
+      ;
+    if(r != id[i] || res != SZ || buf[i][0] != 'a'+N-1-i || buf[i][SZ-1] != 'a'+N-1-i){
+      printf("%s: aioread got wrong data\n", s);
+      exit(1);
+    }
+  }
+
+  // requests bigger than a page.
+  fd = open("aiofile", O_RDWR);
+  for(i = 0; i < BIG; i++)
+    big[i] = i % 251;
+  if((r = aiowrite(fd, big, BIG, SZ)) < 0 || aiowait(r, 1, &res) != r || res != BIG){
+    printf("%s: big aiowrite failed\n", s);
+    exit(1);
+  }
+  memset(big, 0, BIG);
+  if((r = aioread(fd, big, BIG, SZ)) < 0 || aiowait(r, 1, &res) != r || res != BIG){
+    printf("%s: big aioread failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i++){
+    if(big[i] != (char)(i % 251)){
+      printf("%s: big aioread got wrong data\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("aiofile", O_RDONLY);
+  if(aiowrite(fd, buf[0], SZ, 0) != -1 || aioread(fd, buf[0], SZ, -1) != -1){
+    printf("%s: bad aio request worked\n", s);
+    exit(1);
+  }
+  // exit with requests outstanding.
+  pid = fork();
+  if(pid == 0){
+    for(i = 0; i < N; i++)
+      aioread(fd, buf[i], SZ, 0);
+    exit(0);
+  }
+  wait(&xstatus);
+  close(fd);
+  unlink("aiofile");
+  if(xstatus != 0)
+    exit(1);
+}
+
+// shared by threadtest()'s threads.
+static struct ulock tlock;
+static int tcount;
+static int tflag;
+static int tfd;
+
+static void
+threadadd(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++){
+    lockacquire(&tlock);
+    tcount++;
+    lockrelease(&tlock);
   }
+  exit((int)(uint64)arg);
+}
 
-  pause(20); // two seconds
-  close(open("stopforking", O_CREATE|O_RDWR));
-  wait(0);
-  pause(10); // one second
+static void
+threadsignal(void *arg)
+{
+  // the descriptor is the main thread's.
+  if(write(tfd, "x", 1) != 1)
+    exit(1);
+  pause(2);
+  tflag = 1;
+  futex(&tflag, FUTEX_WAKE, 1);
 }
 
-// regression test. does reparent() violate the parent-then-child
-// locking order when giving away a child to init, so that exit()
-// deadlocks against init's wait()? also used to trigger a "panic:
-// release" due to exit() releasing a different p->parent->lock than
-// it acquired.
+static void
+threadspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+// clone(), join(), spin locks and futexes.
 void
-reparent2(char *s)
+threadtest(char *s)
 {
-  for(int i = 0; i < 800; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("fork failed\n");
+  enum { N = 4 };
+  int i, tid[N], xstatus, fds[2], pid;
+  char c;
+
+  lockinit(&tlock);
+  tcount = 0;
+  for(i = 0; i < N; i++){
+    if((tid[i] = threadcreate(threadadd, (void*)(uint64)i)) < 0){
+      printf("%s: threadcreate failed\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      fork();
-      fork();
-      exit(0);
+  }
+  for(i = N-1; i >= 0; i--){
+    if(threadjoin(tid[i], &xstatus) != tid[i] || xstatus != i){
+      printf("%s: threadjoin failed\n", s);
+      exit(1);
     }
-    wait(0);
+  }
+  if(tcount != N*1000){
+    printf("%s: count %d, not %d\n", s, tcount, N*1000);
+    exit(1);
+  }
+  if(join(0, 0) != -1){
+    printf("%s: join found a thread\n", s);
+    exit(1);
   }
 
-  exit(0);
+  // wait on a futex for a thread that writes to a shared pipe.
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  tfd = fds[1];
+  tflag = 0;
+  if((tid[0] = threadcreate(threadsignal, 0)) < 0){
+    printf("%s: threadcreate failed\n", s);
+    exit(1);
+  }
+  while(tflag == 0)
+    futex(&tflag, FUTEX_WAIT, 0);
+  if(read(fds[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: thread's write not seen\n", s);
+    exit(1);
+  }
+  if(threadjoin(tid[0], &xstatus) != tid[0] || xstatus != 0){
+    printf("%s: threadjoin failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // exit() ends a process's threads, even spinning ones; until
+  // then it can't shrink.
+  pid = fork();
+  if(pid == 0){
+    for(i = 0; i < N; i++)
+      if(threadcreate(threadspin, 0) < 0)
+        exit(1);
+    if(sbrk(-PGSIZE) != SBRK_ERROR)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: threaded child failed\n", s);
+    exit(1);
+  }
 }
 
-// allocate all mem, free it, and allocate again
-void
-mem(char *s)
+// shared by futextest()'s threads.
+static struct umutex fmutex;
+static struct ucond fcond;
+static int fitems;
+static int fword;
+
+static void
+futexproducer(void *arg)
 {
-  void *m1, *m2;
-  int pid;
+  int i;
 
-  if((pid = fork()) == 0){
-    m1 = 0;
-    while((m2 = malloc(10001)) != 0){
-      *(char**)m2 = m1;
-      m1 = m2;
-    }
-    while(m1){
-      m2 = *(char**)m1;
-      free(m1);
-      m1 = m2;
-    }
-    m1 = malloc(1024*20);
-    if(m1 == 0){
-      printf("%s: couldn't allocate mem?!!\n", s);
-      exit(1);
-    }
-    free(m1);
-    exit(0);
-  } else {
-    int xstatus;
-    wait(&xstatus);
-    if(xstatus == -1){
-      // probably page fault, so might be lazy lab,
-      // so OK.
-      exit(0);
-    }
-    exit(xstatus);
+  for(i = 0; i < 100; i++){
+    mutexlock(&fmutex);
+    fitems++;
+    condsignal(&fcond);
+    mutexunlock(&fmutex);
   }
 }
 
-// More file system tests
+static void
+futexwaiter(void *arg)
+{
+  if(futexwait(&fword, 0) != 0)
+    exit(1);
+}
 
-// two processes write to the same file descriptor
-// is the offset shared? does inode locking work?
+// futex wait and wake, and the mutexes and condition
+// variables built on them.
 void
-sharedfd(char *s)
+futextest(char *s)
 {
-  int fd, pid, i, n, nc, np;
-  enum { N = 1000, SZ=10};
-  char buf[SZ];
+  enum { N = 4 };
+  int i, tid[N], taken, x, xstatus;
 
-  unlink("sharedfd");
-  fd = open("sharedfd", O_CREATE|O_RDWR);
-  if(fd < 0){
-    printf("%s: cannot open sharedfd for writing", s);
+  x = 0;
+  if(futexwait((int*)1, 0) != -1 || futexwait((int*)(uint64)MAXVA, 0) != -1){
+    printf("%s: futexwait on a bad address worked\n", s);
     exit(1);
   }
-  pid = fork();
-  memset(buf, pid==0?'c':'p', sizeof(buf));
+  if(futexwait(&x, 1) != 0 || futexwake(&x, 1) != 0){
+    printf("%s: futex without waiters failed\n", s);
+    exit(1);
+  }
+
+  // one waiter, woken once.
+  fword = 0;
+  if((tid[0] = threadcreate(futexwaiter, 0)) < 0){
+    printf("%s: threadcreate failed\n", s);
+    exit(1);
+  }
+  while((x = futexwake(&fword, 1)) == 0)
+    pause(1);
+  if(x != 1 || threadjoin(tid[0], &xstatus) != tid[0] || xstatus != 0){
+    printf("%s: futexwake failed\n", s);
+    exit(1);
+  }
+
+  // producers and a consumer.
+  mutexinit(&fmutex);
+  condinit(&fcond);
+  fitems = 0;
   for(i = 0; i < N; i++){
-    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
-      printf("%s: write sharedfd failed\n", s);
+    if((tid[i] = threadcreate(futexproducer, 0)) < 0){
+      printf("%s: threadcreate failed\n", s);
       exit(1);
     }
   }
-  if(pid == 0) {
-    exit(0);
-  } else {
-    int xstatus;
-    wait(&xstatus);
-    if(xstatus != 0)
-      exit(xstatus);
-  }
-  
-  close(fd);
-  fd = open("sharedfd", 0);
-  if(fd < 0){
-    printf("%s: cannot open sharedfd for reading\n", s);
-    exit(1);
+  for(taken = 0; taken < N*100; taken++){
+    mutexlock(&fmutex);
+    while(fitems == 0)
+      condwait(&fcond, &fmutex);
+    fitems--;
+    mutexunlock(&fmutex);
   }
-  nc = np = 0;
-  while((n = read(fd, buf, sizeof(buf))) > 0){
-    for(i = 0; i < sizeof(buf); i++){
-      if(buf[i] == 'c')
-        nc++;
-      if(buf[i] == 'p')
-        np++;
+  for(i = 0; i < N; i++){
+    if(threadjoin(tid[i], &xstatus) != tid[i] || xstatus != 0){
+      printf("%s: threadjoin failed\n", s);
+      exit(1);
     }
   }
-  close(fd);
-  unlink("sharedfd");
-  if(nc == N*SZ && np == N*SZ){
-    exit(0);
-  } else {
-    printf("%s: nc/np test fails\n", s);
+  if(fitems != 0){
+    printf("%s: %d items left\n", s, fitems);
     exit(1);
   }
 }
 
-// four processes write different files at the same
-// time, to test block allocation.
 void
 fourfiles(char *s)
 {
@@ -1864,6 +2989,71 @@ rmdot(char *s)
   }
 }
 
+// the directory lookup cache must follow creates and unlinks,
+// and must forget a directory's names when it is freed.
+void
+dcachetest(char *s)
+{
+  int fd, i;
+
+  if(mkdir("dcd") != 0){
+    printf("%s: mkdir dcd failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++){
+    // a miss, then a create, then a hit.
+    if(open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: dcd/f exists before create\n", s);
+      exit(1);
+    }
+    if((fd = open("dcd/f", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create dcd/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dcd/f", O_RDONLY)) < 0){
+      printf("%s: open dcd/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcd/f") != 0){
+      printf("%s: unlink dcd/f failed\n", s);
+      exit(1);
+    }
+  }
+  if(open("dcd/f", O_RDONLY) >= 0){
+    printf("%s: dcd/f exists after unlink\n", s);
+    exit(1);
+  }
+
+  // a new directory in the old one's place starts out empty.
+  if((fd = open("dcd/g", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create dcd/g failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(open("dcd/g", O_RDONLY) < 0 || unlink("dcd/g") != 0 || unlink("dcd") != 0){
+    printf("%s: remove dcd failed\n", s);
+    exit(1);
+  }
+  if(mkdir("dcd") != 0){
+    printf("%s: mkdir dcd again failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/g", O_RDONLY) >= 0){
+    printf("%s: dcd/g in new dcd\n", s);
+    exit(1);
+  }
+  if(chdir("dcd/..") != 0 || open("dcd", O_RDONLY) < 0){
+    printf("%s: dcd/.. wrong\n", s);
+    exit(1);
+  }
+  if(unlink("dcd") != 0){
+    printf("%s: unlink dcd failed\n", s);
+    exit(1);
+  }
+}
+
 void
 dirfile(char *s)
 {
@@ -1956,9 +3146,9 @@ iref(char *s)
   chdir("/");
 }
 
-// test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// test that fork fails gracefully, once all NPROC kernel stacks
+// are in use. the forktest binary also does this, with a smaller
+// executable.
 void
 forktest(char *s)
 {
@@ -1979,7 +3169,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -1996,6 +3186,44 @@ forktest(char *s)
   }
 }
 
+// freeing a large block gives its memory back to the kernel:
+// with madvise() below the top of the heap, and with sbrk(-n)
+// once the free memory reaches the top.
+void
+mallocrelease(char *s)
+{
+  enum { N=1024*1024, NPG=N/PGSIZE, SLOP=16 };
+  char *a, *b, *top;
+  int free0, free1;
+
+  top = sbrk(0);
+  free0 = countfree();
+  if((a = malloc(N)) == 0 || (b = malloc(N)) == 0){
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  memset(a, 1, N);
+  memset(b, 2, N);
+
+  free(a);
+  free1 = countfree();
+  if(free1 < free0 - NPG - SLOP){
+    printf("%s: free below the top kept %d pages\n", s, free0 - free1);
+    exit(1);
+  }
+
+  free(b);
+  if(sbrk(0) > top + PGSIZE){
+    printf("%s: heap not shrunk: %p above %p\n", s, sbrk(0), top);
+    exit(1);
+  }
+  free1 = countfree();
+  if(free1 < free0 - SLOP){
+    printf("%s: free at the top kept %d pages\n", s, free0 - free1);
+    exit(1);
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2568,7 +3796,141 @@ sbrk8000(char *s)
   *(top-1) = *(top-1) + 1;
 }
 
+// grow the heap with megapages, and check that fork, system
+// calls and shrinking into the middle of a megapage see the
+// right memory.
+void
+sbrkmega(char *s)
+{
+  enum { SZ = 5*1024*1024 };
+  char *a, *top;
+  int fds[2], pid, xstatus, i;
+
+  a = sbrkhuge(SZ);
+  if(a == SBRK_ERROR){
+    printf("%s: sbrkhuge failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += 4096)
+    a[i] = i / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < SZ; i += 4096){
+      if(a[i] != (char)(i / 4096))
+        exit(1);
+      a[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong memory\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += 4096){
+    if(a[i] != (char)(i / 4096)){
+      printf("%s: child's write reached parent\n", s);
+      exit(1);
+    }
+  }
+
+  // copyin() and copyout() across a megapage.
+  if(pipe(fds) != 0 || write(fds[1], a + SZ/2 - 10, 20) != 20 ||
+     read(fds[0], a + SZ/2 + 4096 - 10, 20) != 20 ||
+     memcmp(a + SZ/2 - 10, a + SZ/2 + 4096 - 10, 20) != 0){
+    printf("%s: pipe through megapage failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // shrink to a point inside a megapage, then grow again.
+  top = sbrk(0);
+  if(sbrk(-(SZ/2 + 3*4096)) == SBRK_ERROR){
+    printf("%s: shrink failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ/2 - 3*4096; i += 4096){
+    if(a[i] != (char)(i / 4096)){
+      printf("%s: shrink lost memory\n", s);
+      exit(1);
+    }
+  }
+  if(sbrkhuge(SZ/2 + 3*4096) == SBRK_ERROR || sbrk(0) != top){
+    printf("%s: regrow failed\n", s);
+    exit(1);
+  }
+  // the page holding the break, if any, keeps its contents.
+  for(i = SZ/2 - 2*4096; i < SZ; i += 4096){
+    if(a[i] != 0){
+      printf("%s: regrown memory not zero\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
+
+
+// madvise(MADV_DONTNEED) drops heap pages, which come back as
+// zeros; free() gives a big block at the top of the heap back.
+void
+madvisetest(char *s)
+{
+  enum { N=8 };
+  char *a, *top, *p;
+  int i;
+
+  a = sbrk(N*PGSIZE + PGSIZE);
+  if(a == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a = (char*)PGROUNDUP((uint64)a);
+  for(i = 0; i < N*PGSIZE; i++)
+    a[i] = 1 + i % 100;
+  if(madvise(a + PGSIZE, 2*PGSIZE, MADV_DONTNEED) != 0){
+    printf("%s: madvise failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N*PGSIZE; i++){
+    if(a[i] != (i >= PGSIZE && i < 3*PGSIZE ? 0 : 1 + i % 100)){
+      printf("%s: wrong byte at %d after madvise\n", s, i);
+      exit(1);
+    }
+  }
+  // the pages can be used again.
+  a[PGSIZE] = 'x';
+  if(a[PGSIZE] != 'x'){
+    printf("%s: page not faulted back in\n", s);
+    exit(1);
+  }
+  top = sbrk(0);
+  if(madvise(a + 1, PGSIZE, MADV_DONTNEED) != -1 ||
+     madvise(top, PGSIZE, MADV_DONTNEED) != -1 ||
+     madvise(a, PGSIZE, 99) != -1){
+    printf("%s: bad madvise succeeded\n", s);
+    exit(1);
+  }
 
+  // a large malloc() that is freed gives its memory back.
+  p = malloc(1024*1024);
+  if(p == 0){
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  memset(p, 1, 1024*1024);
+  free(p);
+  if(sbrk(0) > top + 128*1024){
+    printf("%s: free() didn't shrink the heap\n", s);
+    exit(1);
+  }
+}
 
 // regression test. test whether exec() leaks memory if one of the
 // arguments is invalid. the test passes if the kernel doesn't panic.
@@ -2757,6 +4119,7 @@ struct test {
   {copyinstr1, "copyinstr1"},
   {copyinstr2, "copyinstr2"},
   {copyinstr3, "copyinstr3"},
+  {copyinstr4, "copyinstr4"},
   {rwsbrk, "rwsbrk" },
   {truncate1, "truncate1"},
   {truncate2, "truncate2"},
@@ -2770,7 +4133,14 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {exectxtbsy, "exectxtbsy"},
   {pipe1, "pipe1"},
+  {pipebulk, "pipebulk"},
+  {splicetest, "splicetest"},
+  {mmaptest, "mmaptest"},
+  {mmapread, "mmapread"},
+  {mmapcoherent, "mmapcoherent"},
+  {mmapstale, "mmapstale"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -2782,6 +4152,12 @@ struct test {
   {mem, "mem"},
   {sharedfd, "sharedfd"},
   {fourfiles, "fourfiles"},
+  {manyfiles, "manyfiles"},
+  {iovtest, "iovtest"},
+  {ringtest, "ringtest"},
+  {aiotest, "aiotest"},
+  {threadtest, "threadtest"},
+  {futextest, "futextest"},
   {createdelete, "createdelete"},
   {unlinkread, "unlinkread"},
   {linktest, "linktest"},
@@ -2792,10 +4168,12 @@ struct test {
   {bigfile, "bigfile"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
+  {dcachetest, "dcachetest"},
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
   {sbrkbasic, "sbrkbasic"},
+  {mallocrelease, "mallocrelease"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
@@ -2811,6 +4189,8 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrkmega, "sbrkmega"},
+  {madvisetest, "madvisetest"},
   {badarg, "badarg" },
   {lazy_alloc, "lazy_alloc"},
   {lazy_unmap, "lazy_unmap"},
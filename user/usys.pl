@@ -45,4 +45,20 @@ entry("uptime");
 entry("getprocinfo");
 entry("boostproc");  # Week 3: Manual priority boost
 entry("getschedulerstats");  # Week 3: Get scheduler statistics
+entry("splice");
+entry("mmap");
+entry("munmap");
+entry("madvise");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("ringsetup");
+entry("ringenter");
+entry("aioread");
+entry("aiowrite");
+entry("aiowait");
+entry("clone");
+entry("join");
+entry("futex");
 